@@ -4,305 +4,4334 @@
  * @brief CS 444 Operating Systems II Project 2
  */
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE                // mremap()
+#endif // _GNU_SOURCE
+
 #include "beavalloc.h"
 
-static void *lower_mem_bound = NULL;
-static void *upper_mem_bound = NULL;
-static struct linked_list heap = {.head = NULL, .tail = NULL};
+#define BLOCK_DATA(_b)      ((void *)((struct block *)(_b) + 1))
+#define BLOCK_NEXT(_b)      ((struct block *)((char *)BLOCK_DATA(_b) + (_b)->capacity))
+#define BLOCK_FOOTER(_b)    (((size_t *)BLOCK_NEXT(_b))[-1])
+#define BLOCK_TAG(_b)       (BLOCK_MAGIC ^ (uint32_t)((uintptr_t)(_b) >> 4))
+#define FREE_TAG(_b)        (BLOCK_TAG(_b) ^ FREE_KEY)
+#define CACHED_TAG(_b)      (BLOCK_TAG(_b) ^ CACHED_KEY)
+#define FREE_LINKS(_b)      ((struct free_links *)BLOCK_DATA(_b))
+#define FREE_TREE(_b)       ((struct free_tree *)BLOCK_DATA(_b))
+#define IN_TREE(_b)         (BEST_FIT && (_b)->capacity >= TREE_MIN)
+#define SLAB_OF(_p)         ((struct slab *)((uintptr_t)(_p) & ~(SLAB_SIZE - 1)))
+#define SLAB_TAG(_s)        (SLAB_MAGIC ^ (uint32_t)((uintptr_t)(_s) / SLAB_SIZE))
+#define MMAP_BLOCK(_b)      ((struct mmap_block *)((char *)(_b) - offsetof(struct mmap_block, block)))
+#define MMAP_START(_m)      ((void *)((char *)(_m) - (_m)->lead))
+#define MMAP_LENGTH(_m)     ((_m)->lead + sizeof(struct mmap_block) + (_m)->block.capacity)
+
+// Each arena's heap is guarded by the arena's own lock. The arena table
+//   only changes under arenas_lock; lookups read it without the lock.
+static struct beavalloc_arena main_arena = {.lock = PTHREAD_MUTEX_INITIALIZER, .flags = ARENA_SBRK};
+static struct beavalloc_arena *arenas[MAX_ARENAS] = {&main_arena};
+static struct beavalloc_arena *auto_arenas[MAX_AUTO_ARENAS] = {&main_arena};
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint num_arenas = 1;
+static uint num_auto_arenas = 0;
+static uint next_arena = 0;
+
+// Blocks with mappings of their own, guarded by mmap_lock. They are listed
+//   on mmap_blocks and kept in mmap_table, an open addressed set of their
+//   headers mapped straight from the kernel, which doubles once three
+//   quarters full.
+static struct mmap_block *mmap_blocks = NULL;
+static struct mmap_block **mmap_table = NULL;
+static size_t mmap_table_size = 0;
+static size_t mmap_table_used = 0;
+static pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static size_t trim_threshold = TRIM_THRESHOLD;
+
+// The background purge thread runs while decay_ms is set, waiting on
+//   decay_cond between ticks.
+static size_t decay_ms = 0;
+static uint8_t decay_running = FALSE;
+static pthread_t decay_thread;
+static pthread_mutex_t decay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decay_cond;
+static size_t grow_min = GROW_MIN;
+static size_t grow_max = GROW_MAX;
+
+// Slab space runs from slab_base to slab_top, of which everything below
+//   slab_commit is read/write. Released slabs wait in slab_free_index,
+//   a stack of slab numbers kept outside the slabs so a released slab's
+//   page is not written again until it is reused. All of it is guarded
+//   by slab_lock, and each class by its own lock.
+static char *slab_base = NULL;
+static char *slab_top = NULL;
+static char *slab_commit = NULL;
+static uint32_t *slab_free_index = NULL;
+static size_t slab_free_count = 0;
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct slab_class slab_classes[SLAB_CLASSES] = {
+    [0 ... SLAB_CLASSES - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER, .partial = NULL, .remote = NULL}
+};
+
+// Each reset bumps heap_generation so threads know to drop what they
+//   have cached.
+static uint64_t heap_generation = 0;
+
+static __thread struct beavalloc_arena *thread_arena = NULL;
+
+// The last block this thread was handed with BLOCK_ZEROED, which
+//   beavcalloc() need not clear all of.
+static __thread void *zeroed_data = NULL;
+static __thread struct thread_cache tcache;
+static __thread uint8_t tcache_exited = FALSE;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+// One struct cpu_cache per configured CPU, mapped the first time the
+//   caches are turned on. Without rseq cpu_caches stays NULL.
+static struct cpu_cache *cpu_caches = NULL;
+static uint cpu_count = 0;
+static pthread_once_t cpu_cache_once = PTHREAD_ONCE_INIT;
+
+// While a trace is being recorded, trace_fd is open and calls are
+//   encoded into trace_buf, guarded by trace_lock. trace_nested marks the
+//   calls beavalloc makes to itself, which are not recorded. trace_moving
+//   is the block a recorded realloc may move, so the realloc can be
+//   recorded just before the block is let go of.
+static int trace_fd = -1;
+static uint8_t trace_buf[TRACE_BUFFER];
+static size_t trace_len = 0;
+static uint64_t trace_time = 0;
+static uint64_t trace_last_ptr = 0;
+static uint trace_threads = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint trace_thread = 0;
+static __thread uint8_t trace_nested = FALSE;
+static __thread void *trace_moving = NULL;
+
+// Each thread counts what it hands out and caches in its own tstats,
+//   linked on thread_stats_list while the thread lives and added into
+//   retired_stats as it exits. Anything a thread counts after that, from
+//   later destructors, goes straight into retired_stats, since tstats is
+//   about to go. Core taken from the kernel is counted as it changes hands
+//   so its peak is exact.
+static struct thread_stats retired_stats;
+static struct thread_stats *thread_stats_list = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_stats tstats;
+static __thread uint8_t tstats_exited = FALSE;
+static size_t mapped_bytes = 0;
+static size_t peak_mapped = 0;
+static uint64_t sbrk_calls = 0;
+static uint64_t mmap_calls = 0;
+
+// The profiler samples while prof_rate is set. Its tables are guarded by
+//   prof_lock; a signal only marks a dump as pending.
+static size_t prof_rate = 0;
+static size_t prof_last_rate = PROF_RATE;
+static struct prof_bucket *prof_buckets = NULL;
+static struct prof_sample *prof_samples = NULL;
+static uint prof_num_buckets = 0;
+static size_t prof_num_samples = 0;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct prof_thread tprof;
+static volatile sig_atomic_t prof_dump_pending = 0;
+static char prof_signal_path[4096];
+static int prof_signal_format = PROF_PPROF;
+static char prof_out[4096];
+static size_t prof_out_len = 0;
+
+static uint8_t DEBUG = FALSE;
+static uint8_t THREAD_CACHE = TRUE;
+static uint8_t CPU_CACHE = FALSE;
+static uint8_t SLABS = TRUE;
+static uint8_t REMOTE_FREE = TRUE;
+static uint8_t FAST_BINS = TRUE;
+
+static struct beavalloc_arena *arena_get(void);
+static struct beavalloc_arena *arena_new(uint flags);
+static void *arena_more_core(struct beavalloc_arena *arena, size_t bytes);
+static void *arena_top(struct beavalloc_arena *arena);
+static void arena_clear(struct beavalloc_arena *arena);
+static void remote_push(struct beavalloc_arena *arena, struct block *first, struct block *last, uint count);
+static void remote_drain(struct beavalloc_arena *arena);
+static int arena_trim(struct beavalloc_arena *arena, size_t pad);
+static int purge_block(struct block *curr);
+static void *decay_main(void *arg);
+static void decay_tick(struct beavalloc_arena *arena);
+static size_t decay_purge(struct beavalloc_arena *arena, size_t bytes);
+static size_t decay_purge_tree(struct block *curr, size_t bytes);
+static size_t decay_purge_block(struct block *curr, size_t bytes);
+static void zero_block(void *data, size_t size);
+static void *slab_alloc(size_t size);
+static struct slab *slab_new(size_t size);
+static void slab_release(struct slab *slab);
+static struct slab *slab_object(void *ptr);
+static int slab_object_free(struct slab *slab, void *ptr);
+static int slab_owns(void *ptr);
+static void slab_free(void *ptr);
+static int slab_mark_free(struct slab_class *sc, struct slab *slab, size_t i);
+static void slab_remote_free(struct slab_class *sc, struct slab *slab, size_t i);
+static void slab_drain(struct slab_class *sc);
+static void *slab_realloc(void *ptr, size_t size);
+static void slab_link(struct slab_class *sc, struct slab *slab);
+static void slab_unlink(struct slab_class *sc, struct slab *slab);
+static void slab_reset(void);
+static void *mmap_alloc(size_t size);
+static void *mmap_alloc_aligned(size_t alignment, size_t size);
+static void *mmap_realloc(struct block *curr, size_t size);
+static void mmap_shrink(struct block *curr, size_t size);
+static void mmap_free(struct block *curr);
+static struct block *mmap_find(struct block *curr);
+static int mmap_link(struct mmap_block *m);
+static struct mmap_block **mmap_slot(struct mmap_block *m);
+static void mmap_table_grow(void);
+static void mmap_unlink(struct mmap_block *m);
+static void *heap_alloc(struct beavalloc_arena *arena, size_t size);
+static void *heap_alloc_room(struct beavalloc_arena *arena, size_t size, size_t room);
+static void heap_free(struct beavalloc_arena *arena, struct block *curr);
+static void fast_free(struct beavalloc_arena *arena, struct block *curr);
+static void *fast_alloc(struct beavalloc_arena *arena, size_t size);
+static void fast_consolidate(struct beavalloc_arena *arena);
+static int heap_grow(struct beavalloc_arena *arena, struct block *curr, size_t size);
+static int grow_in_place(struct beavalloc_arena *arena, struct block *curr, size_t size);
+static void heap_shrink(struct beavalloc_arena *arena, struct block *curr, size_t size);
+static void *heap_alloc_aligned(struct beavalloc_arena *arena, size_t alignment, size_t size);
+static void tcache_init(void);
+static void tcache_destroy(void *arg);
+static struct thread_cache *tcache_get(void);
+static void *tcache_alloc(size_t size);
+static void tcache_refill(struct thread_cache *tc, size_t size);
+static void tcache_push(struct thread_cache *tc, struct block *curr);
+static void tcache_free(struct block *curr);
+static void tcache_flush(struct thread_cache *tc, size_t i, uint count);
+static void cpu_cache_init(void);
+static int cpu_cache_pop(size_t i, void **data);
+static int cpu_cache_push(size_t i, void *data);
+static void *cpu_cache_alloc(size_t size);
+static int cpu_cache_free_block(struct block *curr);
+static int cpu_cache_free_object(void *ptr);
+static void *make_block(struct beavalloc_arena *arena, size_t size);
+static size_t determine_needed_bytes(size_t size);
+static size_t arena_grow_bytes(struct beavalloc_arena *arena, size_t bytes);
+static void *region_more(struct beavalloc_region *region, size_t size);
+static struct block *initialize_new_block(struct beavalloc_arena *arena, void *new, size_t bytes);
+static size_t bin_index(size_t size);
+static void bin_insert(struct beavalloc_arena *arena, struct block *curr);
+static void bin_remove(struct beavalloc_arena *arena, struct block *curr);
+static struct block *find_free_block(struct beavalloc_arena *arena, size_t size);
+static void list_insert(struct beavalloc_arena *arena, struct block *curr);
+static void list_remove(struct beavalloc_arena *arena, struct block *curr);
+static struct block *list_fit(struct block *from, struct block *to, size_t needed);
+static struct block *list_find(struct beavalloc_arena *arena, size_t needed);
+static int tree_before(struct block *a, struct block *b);
+static uint32_t tree_priority(struct block *curr);
+static void tree_insert(struct block **root, struct block *curr);
+static void tree_remove(struct block **root, struct block *curr);
+static struct block *tree_best_fit(struct block *root, size_t needed);
+static int tree_purge(struct block *curr);
+static void *get_free_block(struct beavalloc_arena *arena, struct block *curr, size_t size);
+static struct block *block_from_ptr(void *ptr, struct beavalloc_arena **owner);
+static void mark_free(struct block *curr);
+static void mark_used(struct block *curr);
+static void split_free_block(struct beavalloc_arena *arena, struct block *curr, size_t size);
+static struct block *coalesce_blocks(struct beavalloc_arena *arena, struct block *curr);
+static void coalesce_right(struct beavalloc_arena *arena, struct block *curr);
+static struct block *coalesce_left(struct beavalloc_arena *arena, struct block *curr);
+static void dump_arena(struct beavalloc_arena *arena, uint leaks_only);
+static void dump_mapped(uint leaks_only);
+static void dump_slabs(uint leaks_only);
+static struct thread_stats *stats_get(void);
+static void stats_init(void);
+static void stats_destroy(void *arg);
+static void stats_used(struct beavalloc_arena *arena, int64_t bytes, int64_t blocks);
+static void stats_cached(int64_t bytes);
+static void stats_count(int64_t bytes, int64_t blocks, int64_t cached);
+static void stats_mapped(struct beavalloc_arena *arena, int64_t bytes);
+static void stats_reset(void);
+static void *heap_alloc_thread(size_t size, size_t room);
+static int prof_due(size_t size);
+static void *prof_alloc(size_t size) __attribute__((noinline));
+static void prof_record(void *data, size_t size, uint skip) __attribute__((noinline));
+static void prof_free(struct beavalloc_arena *arena, struct block *curr);
+static void prof_move(void *old, void *new);
+static int64_t prof_next(void);
+static struct prof_bucket *prof_bucket_get(void **pcs, uint depth);
+static struct prof_sample *prof_sample_slot(void *ptr);
+static void prof_sample_remove(struct prof_sample *sample);
+static void prof_reset(void);
+static void prof_handler(int signo);
+static void prof_write_pprof(int fd);
+static void prof_write_folded(int fd);
+static void prof_frame(void *pc, char *name, size_t len);
+static void prof_put(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void prof_flush(int fd);
+static void *trace_call(uint op, void *ptr, size_t arg, size_t size);
+static void trace_record(uint op, void *ptr, size_t arg, size_t size, void *result);
+static void trace_moved(void *ptr, size_t size, void *result);
+static void trace_flush(void);
+static uint64_t trace_now(void);
+static void trace_put(uint64_t v);
+static void trace_put_ptr(uint64_t ptr);
+static int trace_get(FILE *in, uint64_t *v);
+static int trace_get_ptr(FILE *in, struct beavalloc_trace_rec *rec, uint64_t *ptr);
+static void diagnostic_message(const char *message);
+
+void *beavalloc(size_t size)
+{
+    if (trace_fd >= 0 && !trace_nested) {
+        return trace_call(TRACE_ALLOC, NULL, 0, size);
+    }
+    if (size == (size_t)NULL) {
+        if (DEBUG) { diagnostic_message("beavalloc: size = NULL"); }
+        return NULL;
+    }
+
+    if (prof_rate && prof_due(size)) {
+        return prof_alloc(size);
+    }
+    if (mmap_threshold && size >= mmap_threshold) {
+        return mmap_alloc(size);
+    }
+    if (CPU_CACHE && MAX(ALIGN_SIZE(size), MIN_CAPACITY) <= TCACHE_MAX) {
+        void *data = cpu_cache_alloc(size);
+
+        if (data != NULL) {
+            return data;
+        }
+    }
+    if (SLABS && size <= SLAB_MAX) {
+        return slab_alloc(size);
+    }
+    if (THREAD_CACHE && !tcache_exited && MAX(ALIGN_SIZE(size), MIN_CAPACITY) <= TCACHE_MAX) {
+        return tcache_alloc(size);
+    }
+
+    return heap_alloc_thread(size, 0);
+}
+
+// Allocate from the calling thread's arena. A full arena is not out of
+//   memory while the break can still move, so the default arena is tried
+//   after it.
+static void *heap_alloc_thread(size_t size, size_t room)
+{
+    struct beavalloc_arena *arena = arena_get();
+    void *data = NULL;
+
+    pthread_mutex_lock(&arena->lock);
+    data = heap_alloc_room(arena, size, room);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (data == NULL && arena != &main_arena) {
+        pthread_mutex_lock(&main_arena.lock);
+        data = heap_alloc_room(&main_arena, size, room);
+        pthread_mutex_unlock(&main_arena.lock);
+    }
+
+    if (data != NULL) {
+        stats_used(NULL, ((struct block *)data - 1)->capacity, 1);
+    }
+    return data;
+}
+
+void *beavalloc_aligned(size_t alignment, size_t size)
+{
+    void *data = NULL;
+    struct beavalloc_arena *arena = NULL;
+
+    if (trace_fd >= 0 && !trace_nested) {
+        return trace_call(TRACE_ALIGNED, NULL, alignment, size);
+    }
+    if (alignment == 0 || (alignment & (alignment - 1))) {
+        if (DEBUG) { diagnostic_message("beavalloc_aligned: alignment not a power of two"); }
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGNMENT) {
+        return beavalloc(size);
+    }
+    if (size == 0) {
+        return NULL;
+    }
+
+    // Slab objects only promise ALIGNMENT, so anything more comes from
+    //   the heap, or from a mapping placed to suit.
+    if (mmap_threshold && size >= mmap_threshold) {
+        data = mmap_alloc_aligned(alignment, size);
+    }
+    else {
+        arena = arena_get();
+        pthread_mutex_lock(&arena->lock);
+        data = heap_alloc_aligned(arena, alignment, size);
+        pthread_mutex_unlock(&arena->lock);
+
+        if (data == NULL && arena != &main_arena) {
+            pthread_mutex_lock(&main_arena.lock);
+            data = heap_alloc_aligned(&main_arena, alignment, size);
+            pthread_mutex_unlock(&main_arena.lock);
+        }
+        if (data != NULL) {
+            stats_used(NULL, ((struct block *)data - 1)->capacity, 1);
+        }
+    }
+
+    if (data != NULL && prof_rate && prof_due(size)) {
+        prof_record(data, size, 2);
+    }
+    return data;
+}
+
+void *beavmemalign(size_t alignment, size_t size)
+{
+    return beavalloc_aligned(alignment, size);
+}
+
+void *beavaligned_alloc(size_t alignment, size_t size)
+{
+    return beavalloc_aligned(alignment, size);
+}
+
+int beavposix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *data = NULL;
+
+    if (alignment == 0 || alignment % sizeof(void *) || (alignment & (alignment - 1))) {
+        return EINVAL;
+    }
+
+    data = beavalloc_aligned(alignment, size);
+    if (data == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = data;
+    return 0;
+}
+
+// The arena this thread allocates from. Threads are dealt the automatic
+//   arenas round-robin, the first being the default sbrk() arena, so a
+//   single threaded program only ever uses the default arena.
+static struct beavalloc_arena *arena_get(void)
+{
+    uint i = 0;
+
+    if (thread_arena != NULL) {
+        return thread_arena;
+    }
+
+    pthread_mutex_lock(&arenas_lock);
+    if (num_auto_arenas == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        num_auto_arenas = MIN(MAX(cpus, 1) * 4, MAX_AUTO_ARENAS);
+    }
+    i = next_arena++ % num_auto_arenas;
+    if (auto_arenas[i] == NULL) {
+        auto_arenas[i] = arena_new(0);
+    }
+    thread_arena = auto_arenas[i] != NULL ? auto_arenas[i] : &main_arena;
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (DEBUG) { diagnostic_message("thread assigned an arena"); }
+    return thread_arena;
+}
+
+// Reserve the address space for a new arena. The arena itself lives in
+//   the first page(s) of the reservation and its heap starts right after.
+//   The caller holds arenas_lock.
+static struct beavalloc_arena *arena_new(uint flags)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t header = (sizeof(struct beavalloc_arena) + page - 1) & ~(page - 1);
+    struct beavalloc_arena *arena = NULL;
+    uint i = 0;
+
+    for (i = 0; i < MAX_ARENAS && arenas[i] != NULL; i++)
+        ;
+    if (i == MAX_ARENAS) {
+        return NULL;
+    }
+
+    arena = mmap(NULL, ARENA_RESERVE, PROT_NONE
+                 , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    __atomic_add_fetch(&mmap_calls, 2, __ATOMIC_RELAXED);
+    if (arena == MAP_FAILED) {
+        return NULL;
+    }
+    if (mprotect(arena, header, PROT_READ | PROT_WRITE) != 0) {
+        munmap(arena, ARENA_RESERVE);
+        return NULL;
+    }
+
+    pthread_mutex_init(&arena->lock, NULL);
+    arena->index = i;
+    arena->flags = flags;
+    arena->lower_mem_bound = (char *)arena + header;
+    arena->upper_mem_bound = arena->lower_mem_bound;
+    arena->commit_end = arena->lower_mem_bound;
+    arena->reserve_end = (char *)arena + ARENA_RESERVE;
+
+    __atomic_store_n(&arenas[i], arena, __ATOMIC_RELEASE);
+    __atomic_store_n(&num_arenas, MAX(num_arenas, i + 1), __ATOMIC_RELEASE);
+
+    if (DEBUG) { diagnostic_message("arena created"); }
+    return arena;
+}
+
+// Extend the arena's heap by bytes, the way sbrk() does for the default
+//   arena. Other arenas commit their reservation ARENA_CHUNK at a time.
+static void *arena_more_core(struct beavalloc_arena *arena, size_t bytes)
+{
+    char *new = arena->upper_mem_bound;
+
+    if (arena->flags & ARENA_SBRK) {
+        new = sbrk(bytes);
+        __atomic_add_fetch(&sbrk_calls, 1, __ATOMIC_RELAXED);
+        if (new != (void *)-1) {
+            stats_mapped(arena, bytes);
+        }
+        return new;
+    }
+
+    if (bytes > (size_t)((char *)arena->reserve_end - new)) {
+        return (void *)-1;
+    }
+    if (new + bytes > (char *)arena->commit_end) {
+        size_t grow = new + bytes - (char *)arena->commit_end;
+
+        grow = MIN((grow + ARENA_CHUNK - 1) & ~(ARENA_CHUNK - 1)
+                   , (size_t)((char *)arena->reserve_end - (char *)arena->commit_end));
+        __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+        if (mprotect(arena->commit_end, grow, PROT_READ | PROT_WRITE) != 0) {
+            return (void *)-1;
+        }
+        arena->commit_end = (char *)arena->commit_end + grow;
+        stats_mapped(arena, grow);
+    }
+    return new;
+}
+
+// Where the arena's next core will start.
+static void *arena_top(struct beavalloc_arena *arena)
+{
+    return (arena->flags & ARENA_SBRK) ? sbrk(0) : arena->upper_mem_bound;
+}
+
+// Forget everything in the arena's heap. The caller holds the arena lock.
+static void arena_clear(struct beavalloc_arena *arena)
+{
+    arena->heap.head = NULL;
+    arena->heap.tail = NULL;
+    memset(arena->bins, 0, sizeof(arena->bins));
+    memset(arena->bin_map, 0, sizeof(arena->bin_map));
+    arena->free_list = NULL;
+    arena->rover = NULL;
+    arena->grow = 0;
+    arena->remote_free = NULL;
+    arena->remote_count = 0;
+    memset(arena->fast, 0, sizeof(arena->fast));
+    arena->fast_bytes = 0;
+    arena->dirty = 0;
+    memset(arena->decay_freed, 0, sizeof(arena->decay_freed));
+    memset(&arena->stats, 0, sizeof(arena->stats));
+}
+
+// Hand blocks of the arena, already counted as freed and linked through
+//   their first word from first to last, to whoever next allocates from
+//   it. See REMOTE_BATCH.
+static void remote_push(struct beavalloc_arena *arena, struct block *first, struct block *last, uint count)
+{
+    struct block *head = __atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED);
+
+    do {
+        *(struct block **)BLOCK_DATA(last) = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote_free, &head, first, TRUE
+                                          , __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (__atomic_add_fetch(&arena->remote_count, count, __ATOMIC_RELAXED) >= REMOTE_BATCH
+        && pthread_mutex_trylock(&arena->lock) == 0) {
+        remote_drain(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+// Free every block other threads have pushed. The caller holds the arena
+//   lock.
+static void remote_drain(struct beavalloc_arena *arena)
+{
+    struct block *curr = __atomic_exchange_n(&arena->remote_free, NULL, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&arena->remote_count, 0, __ATOMIC_RELAXED);
+    while (curr != NULL) {
+        struct block *next = *(struct block **)BLOCK_DATA(curr);
+
+        fast_free(arena, curr);
+        curr = next;
+    }
+    if (DEBUG) { diagnostic_message("remote frees drained"); }
+}
+
+// Shrink the free block at the top of the heap down to pad bytes and give
+//   the whole pages past it back. The default arena can only do this when
+//   the break still ends at its tail. The caller holds the arena lock.
+static int arena_trim(struct beavalloc_arena *arena, size_t pad)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct block *tail = arena->heap.tail;
+    struct block *top = NULL;
+    char *end = NULL;
+    char *new_end = NULL;
+
+    if (tail == NULL || !(tail->flags & BLOCK_PREV_FREE)) {
+        return 0;
+    }
+    top = (struct block *)((char *)tail - ((size_t *)tail)[-1] - META_DATA);
+    end = BLOCK_DATA(tail);
+    if (pad > (size_t)(end - (char *)BLOCK_DATA(top))) {
+        return 0;
+    }
+    new_end = (char *)BLOCK_DATA(top) + MAX(ALIGN_SIZE(pad), MIN_CAPACITY) + META_DATA;
+    new_end = (char *)(((uintptr_t)new_end + page - 1) & ~(page - 1));
+    if (new_end >= end || ((arena->flags & ARENA_SBRK) && sbrk(0) != end)) {
+        return 0;
+    }
+
+    // The pages go back first, so a failure leaves the arena as it was.
+    if (arena->flags & ARENA_SBRK) {
+        __atomic_add_fetch(&sbrk_calls, 1, __ATOMIC_RELAXED);
+        if (brk(new_end) != 0) {
+            if (DEBUG) { diagnostic_message("failed to trim heap"); }
+            return 0;
+        }
+        stats_mapped(arena, -(end - new_end));
+    }
+    else {
+        __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+        if (mmap(new_end, (char *)arena->commit_end - new_end, PROT_NONE
+                 , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+            if (DEBUG) { diagnostic_message("failed to trim heap"); }
+            return 0;
+        }
+        stats_mapped(arena, -((char *)arena->commit_end - new_end));
+        arena->commit_end = new_end;
+    }
+
+    bin_remove(arena, top);
+    top->capacity = new_end - (char *)BLOCK_DATA(top) - META_DATA;
+    tail = BLOCK_NEXT(top);
+    tail->magic = 0;
+    tail->flags = BLOCK_USED;
+    tail->capacity = 0;
+    mark_free(top);
+    bin_insert(arena, top);
+    arena->heap.tail = tail;
+    __atomic_store_n(&arena->upper_mem_bound, new_end, __ATOMIC_RELEASE);
+
+    if (DEBUG) { diagnostic_message("heap trimmed!"); }
+    return 1;
+}
+
+// Drop the whole pages inside a free block, leaving its links and footer.
+//   The tree's links are the longer of the two. The kernel hands the
+//   pages back zeroed, which BLOCK_ZEROED records.
+static int purge_block(struct block *curr)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)(FREE_TREE(curr) + 1) + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t)&BLOCK_FOOTER(curr) & ~(page - 1);
+
+    if (start >= end) {
+        return 0;
+    }
+    madvise((void *)start, end - start, MADV_DONTNEED);
+    curr->flags |= BLOCK_ZEROED;
+    return 1;
+}
+
+// The background purge thread. Each tick runs over every arena under the
+//   same locks beavalloc_trim() takes.
+static void *decay_main(void *arg)
+{
+    struct timespec when;
+
+    (void) arg;
+    pthread_mutex_lock(&decay_lock);
+    while (decay_ms) {
+        uint64_t step = decay_ms * 1000000 / DECAY_STEPS;
+        uint i = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &when);
+        when.tv_sec += (when.tv_nsec + step) / 1000000000;
+        when.tv_nsec = (when.tv_nsec + step) % 1000000000;
+        if (pthread_cond_timedwait(&decay_cond, &decay_lock, &when) != ETIMEDOUT) {
+            continue;
+        }
+        pthread_mutex_unlock(&decay_lock);
+
+        pthread_mutex_lock(&arenas_lock);
+        for (i = 0; i < num_arenas; i++) {
+            struct beavalloc_arena *arena = arenas[i];
+
+            if (arena == NULL) {
+                continue;
+            }
+            pthread_mutex_lock(&arena->lock);
+            if (arena->remote_free != NULL) {
+                remote_drain(arena);
+            }
+            decay_tick(arena);
+            pthread_mutex_unlock(&arena->lock);
+        }
+        pthread_mutex_unlock(&arenas_lock);
+
+        pthread_mutex_lock(&decay_lock);
+    }
+    pthread_mutex_unlock(&decay_lock);
+    return NULL;
+}
+
+// Close the arena's current tick and purge whatever is dirty past what
+//   the decay curve allows. The caller holds the arena lock.
+static void decay_tick(struct beavalloc_arena *arena)
+{
+    double allowed = 0;
+    uint k = 0;
+
+    for (k = 0; k < DECAY_STEPS; k++) {
+        double t = (double) (k + 1) / DECAY_STEPS;
+
+        allowed += arena->decay_freed[(arena->decay_epoch + DECAY_STEPS - k) % DECAY_STEPS]
+            * (1 - t * t * (3 - 2 * t));
+    }
+    arena->decay_epoch = (arena->decay_epoch + 1) % DECAY_STEPS;
+    arena->decay_freed[arena->decay_epoch] = 0;
+
+    // Blocks handed out again since they were freed are no longer dirty.
+    arena->dirty = MIN(arena->dirty, arena->stats.free);
+    if (arena->dirty > (size_t) allowed) {
+        size_t purged = decay_purge(arena, arena->dirty - (size_t) allowed);
+
+        arena->dirty -= MIN(purged, arena->dirty);
+    }
+}
+
+// Purge up to about bytes of free memory: what the top of the heap can
+//   spare first, then the largest free blocks about the size of what is
+//   left.
+//   Returns how much went.
+//   The caller holds the arena lock.
+static size_t decay_purge(struct beavalloc_arena *arena, size_t bytes)
+{
+    struct block *tail = arena->heap.tail;
+    struct block *curr = NULL;
+    char *end = arena->upper_mem_bound;
+    size_t first = bin_index(2 * sysconf(_SC_PAGESIZE));
+    size_t purged = 0;
+    size_t j = NUM_BINS;
+
+    if (tail != NULL && (tail->flags & BLOCK_PREV_FREE)) {
+        size_t top = ((size_t *)tail)[-1];
+
+        if (arena_trim(arena, top > bytes ? top - bytes : 0)) {
+            purged += end - (char *)arena->upper_mem_bound;
+        }
+    }
+    while (purged < bytes && j-- > first) {
+        curr = arena->bins[j];
+        if (curr != NULL && IN_TREE(curr)) {
+            purged += decay_purge_tree(curr, bytes - purged);
+            continue;
+        }
+        for ( ; curr != NULL && purged < bytes; curr = FREE_LINKS(curr)->next) {
+            purged += decay_purge_block(curr, bytes - purged);
+        }
+    }
+    for (curr = arena->free_list; curr != NULL && purged < bytes; curr = FREE_LINKS(curr)->next) {
+        purged += decay_purge_block(curr, bytes - purged);
+    }
+    return purged;
+}
+
+static size_t decay_purge_tree(struct block *curr, size_t bytes)
+{
+    size_t purged = 0;
+
+    if (curr == NULL) {
+        return 0;
+    }
+    purged = decay_purge_block(curr, bytes);
+    if (purged < bytes) {
+        purged += decay_purge_tree(FREE_TREE(curr)->right, bytes - purged);
+    }
+    if (purged < bytes) {
+        purged += decay_purge_tree(FREE_TREE(curr)->left, bytes - purged);
+    }
+    return purged;
+}
+
+// Purge a free block not purged since it was last freed, returning its
+//   capacity, or 0 if there was nothing to do. A block goes once at least
+//   half of it is due; one bigger waits for a later tick rather than
+//   going early. dirty is only an estimate, so demanding all of it could
+//   leave a block waiting for good.
+static size_t decay_purge_block(struct block *curr, size_t bytes)
+{
+    if (curr->capacity / 2 > bytes || (curr->flags & BLOCK_ZEROED) || !purge_block(curr)) {
+        return 0;
+    }
+    return curr->capacity;
+}
+
+// Clear the first size bytes of a block just allocated. Of a block with
+//   BLOCK_ZEROED only what lies outside the pages purge_block() would
+//   drop is cleared; a mapped block is all zero already.
+static void zero_block(void *data, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct block *curr = (struct block *)data - 1;
+    char *start = NULL;
+    char *end = NULL;
+
+    if (data != zeroed_data || slab_owns(data)) {
+        memset(data, 0, size);
+        return;
+    }
+    if (curr->flags & BLOCK_MMAPPED) {
+        return;
+    }
+    start = (char *)(((uintptr_t)(FREE_TREE(curr) + 1) + page - 1) & ~(page - 1));
+    end = (char *)((uintptr_t)&BLOCK_FOOTER(curr) & ~(page - 1));
+    if (start >= end) {
+        memset(data, 0, size);
+        return;
+    }
+    memset(data, 0, MIN(size, (size_t)(start - (char *)data)));
+    if ((char *)data + size > end) {
+        memset(end, 0, (char *)data + size - end);
+    }
+}
+
+int beavalloc_trim(size_t pad)
+{
+    uint count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    size_t first = bin_index(2 * sysconf(_SC_PAGESIZE));
+    int released = 0;
+    uint i = 0;
+
+    pthread_mutex_lock(&arenas_lock);
+    for (i = 0; i < count; i++) {
+        struct beavalloc_arena *arena = arenas[i];
+        struct block *curr = NULL;
+        size_t j = 0;
+
+        if (arena == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        if (arena->remote_free != NULL) {
+            remote_drain(arena);
+        }
+        fast_consolidate(arena);
+        released |= arena_trim(arena, pad);
+        for (curr = arena->free_list; curr != NULL; curr = FREE_LINKS(curr)->next) {
+            released |= purge_block(curr);
+        }
+        for (j = first; j < NUM_BINS; j++) {
+            curr = arena->bins[j];
+            if (curr != NULL && IN_TREE(curr)) {
+                released |= tree_purge(curr);
+                continue;
+            }
+            for (curr = arena->bins[j]; curr != NULL; curr = FREE_LINKS(curr)->next) {
+                released |= purge_block(curr);
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+
+    return released;
+}
+
+struct beavalloc_arena *beavalloc_arena_create(void)
+{
+    struct beavalloc_arena *arena = NULL;
+
+    pthread_mutex_lock(&arenas_lock);
+    arena = arena_new(ARENA_USER);
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (arena == NULL) {
+        if (DEBUG) { diagnostic_message("beavalloc_arena_create: failed to reserve memory"); }
+        errno = ENOMEM;
+    }
+    return arena;
+}
+
+void beavalloc_arena_destroy(struct beavalloc_arena *arena)
+{
+    if (arena == NULL || !(arena->flags & ARENA_USER)) {
+        if (DEBUG) { diagnostic_message("beavalloc_arena_destroy: not a user arena"); }
+        return;
+    }
+
+    // The arena must be idle, as it is unmapped with its lock. A call
+    //   found holding the lock is one the caller let run, so the arena is
+    //   left as it is rather than pulled out from under it. Only trying
+    //   the lock keeps to the order of arenas_lock first.
+    pthread_mutex_lock(&arenas_lock);
+    if (pthread_mutex_trylock(&arena->lock) != 0) {
+        pthread_mutex_unlock(&arenas_lock);
+        if (DEBUG) { diagnostic_message("beavalloc_arena_destroy: arena in use"); }
+        return;
+    }
+    __atomic_store_n(&arenas[arena->index], NULL, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&arenas_lock);
+    pthread_mutex_unlock(&arena->lock);
+
+    pthread_mutex_destroy(&arena->lock);
+    stats_mapped(NULL, -arena->stats.mapped);
+    __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    munmap(arena, ARENA_RESERVE);
+
+    if (DEBUG) { diagnostic_message("arena destroyed"); }
+}
+
+void *beavalloc_arena_alloc(struct beavalloc_arena *arena, size_t size)
+{
+    void *data = NULL;
+
+    if (arena == NULL || size == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    data = heap_alloc(arena, size);
+    if (data != NULL) {
+        stats_used(arena, ((struct block *)data - 1)->capacity, 1);
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return data;
+}
+
+void beavalloc_arena_free(struct beavalloc_arena *arena, void *ptr)
+{
+    struct beavalloc_arena *owner = NULL;
+    struct block *curr = NULL;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    curr = block_from_ptr(ptr, &owner);
+    if (curr == NULL || owner != arena || curr->magic != BLOCK_TAG(curr)) {
+        if (DEBUG) { diagnostic_message("beavalloc_arena_free: invalid address given"); }
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    stats_used(arena, -curr->capacity, -1);
+    fast_free(arena, curr);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+struct beavalloc_region *beavalloc_region_create(void)
+{
+    struct region_chunk *chunk = beavalloc(REGION_CHUNK_MIN);
+    struct beavalloc_region *region = NULL;
+
+    if (chunk == NULL) {
+        if (DEBUG) { diagnostic_message("beavalloc_region_create: no memory for the first chunk"); }
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->end = (char *)chunk + REGION_CHUNK_MIN;
+    region = (struct beavalloc_region *)(chunk + 1);
+    region->first = chunk;
+    region->next_size = MIN(REGION_CHUNK_MIN * 2, REGION_CHUNK_MAX);
+    beavalloc_region_reset(region);
+
+    if (DEBUG) { diagnostic_message("region created"); }
+    return region;
+}
+
+// The first chunk goes last, since the region lives in it.
+void beavalloc_region_destroy(struct beavalloc_region *region)
+{
+    struct region_chunk *chunk = NULL;
+    struct region_chunk *next = NULL;
+
+    if (region == NULL) {
+        return;
+    }
+    for (chunk = region->first->next; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        beavfree(chunk);
+    }
+    beavfree(region->first);
+
+    if (DEBUG) { diagnostic_message("region destroyed"); }
+}
+
+void *beavalloc_region_alloc(struct beavalloc_region *region, size_t size)
+{
+    char *data = NULL;
+
+    if (region == NULL || size == 0 || size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size = ALIGN_SIZE(size);
+    if (size > (size_t)(region->curr->end - region->top)) {
+        return region_more(region, size);
+    }
+    data = region->top;
+    region->top += size;
+    return data;
+}
+
+// Move on to the next chunk if the request fits in it, which after a
+//   reset it usually does, and otherwise put a new chunk in before it.
+static void *region_more(struct beavalloc_region *region, size_t size)
+{
+    struct region_chunk *next = region->curr->next;
+    size_t bytes = 0;
+
+    if (next == NULL || size > (size_t)(next->end - (char *)(next + 1))) {
+        bytes = MAX(region->next_size, size + sizeof(*next));
+        next = beavalloc(bytes);
+        if (next == NULL) {
+            if (DEBUG) { diagnostic_message("beavalloc_region_alloc: no memory for a new chunk"); }
+            return NULL;
+        }
+        next->next = region->curr->next;
+        next->end = (char *)next + bytes;
+        region->curr->next = next;
+        region->next_size = MIN(region->next_size * 2, REGION_CHUNK_MAX);
+    }
+    region->curr = next;
+    region->top = (char *)(next + 1) + size;
+    return next + 1;
+}
+
+// Every chunk is kept, so a region reset at the end of each request soon
+//   stops asking the heap for anything.
+void beavalloc_region_reset(struct beavalloc_region *region)
+{
+    if (region == NULL) {
+        return;
+    }
+    region->curr = region->first;
+    region->top = (char *)region->first + sizeof(*region->first) + ALIGN_SIZE(sizeof(*region));
+}
+
+// Hand out the first free object of the size's class, from the first
+//   slab of the class that has one.
+static void *slab_alloc(size_t size)
+{
+    struct slab_class *sc = &slab_classes[ALIGN_SIZE(size) / ALIGNMENT - 1];
+    struct slab *slab = NULL;
+    size_t word = 0;
+    size_t bit = 0;
+
+    pthread_mutex_lock(&sc->lock);
+    if (__atomic_load_n(&sc->remote, __ATOMIC_RELAXED) != NULL) {
+        slab_drain(sc);
+    }
+    slab = sc->partial;
+    if (slab == NULL) {
+        slab = slab_new(ALIGN_SIZE(size));
+        if (slab == NULL) {
+            pthread_mutex_unlock(&sc->lock);
+            if (DEBUG) { diagnostic_message("failed to allocate slab"); }
+            errno = ENOMEM;
+            return NULL;
+        }
+        slab_link(sc, slab);
+    }
+    while (slab->free_map[word] == 0) {
+        word++;
+    }
+    bit = __builtin_ctzl(slab->free_map[word]);
+    slab->free_map[word] &= ~(1UL << bit);
+    if (--slab->free == 0) {
+        slab_unlink(sc, slab);
+    }
+    pthread_mutex_unlock(&sc->lock);
+    stats_used(NULL, slab->size, 1);
+
+    return (char *)slab + slab->first + (word * 64 + bit) * slab->size;
+}
+
+// Set up an empty slab for objects of size bytes, reusing a released slab
+//   or committing more of the slab range. Reserves the range on first use.
+static struct slab *slab_new(size_t size)
+{
+    struct slab *slab = NULL;
+    size_t i = 0;
+
+    pthread_mutex_lock(&slab_lock);
+    if (slab_free_count) {
+        slab = (struct slab *)(slab_base + (size_t)slab_free_index[--slab_free_count] * SLAB_SIZE);
+    }
+    else {
+        if (slab_base == NULL) {
+            char *base = mmap(NULL, SLAB_RESERVE, PROT_NONE
+                              , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            uint32_t *index = mmap(NULL, SLAB_COUNT * sizeof(uint32_t), PROT_READ | PROT_WRITE
+                                   , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+            __atomic_add_fetch(&mmap_calls, 2, __ATOMIC_RELAXED);
+
+            if (base == MAP_FAILED || index == MAP_FAILED) {
+                if (base != MAP_FAILED) {
+                    munmap(base, SLAB_RESERVE);
+                }
+                if (index != MAP_FAILED) {
+                    munmap(index, SLAB_COUNT * sizeof(uint32_t));
+                }
+                pthread_mutex_unlock(&slab_lock);
+                return NULL;
+            }
+            slab_free_index = index;
+            slab_top = slab_commit = base;
+            __atomic_store_n(&slab_base, base, __ATOMIC_RELEASE);
+        }
+        if (slab_top == slab_commit) {
+            if (slab_commit == slab_base + SLAB_RESERVE
+                || mprotect(slab_commit, SLAB_CHUNK, PROT_READ | PROT_WRITE) != 0) {
+                pthread_mutex_unlock(&slab_lock);
+                return NULL;
+            }
+            slab_commit += SLAB_CHUNK;
+            __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+            stats_mapped(NULL, SLAB_CHUNK);
+        }
+        slab = (struct slab *)slab_top;
+        __atomic_store_n(&slab_top, slab_top + SLAB_SIZE, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&slab_lock);
+
+    slab->magic = SLAB_TAG(slab);
+    slab->size = size;
+    slab->first = ALIGN_SIZE(sizeof(struct slab));
+    slab->count = (SLAB_SIZE - slab->first) / size;
+    slab->free = slab->count;
+    slab->remote_pending = 0;
+    slab->remote_next = NULL;
+    memset(slab->free_map, 0, sizeof(slab->free_map));
+    memset(slab->remote_map, 0, sizeof(slab->remote_map));
+    memset(slab->cached_map, 0, sizeof(slab->cached_map));
+    for (i = 0; i < slab->count; i++) {
+        slab->free_map[i / 64] |= 1UL << (i % 64);
+    }
+
+    if (DEBUG) { diagnostic_message("slab made!"); }
+    return slab;
+}
+
+// Give an empty slab's page back to the kernel and keep the slab for any
+//   class that needs one. The page is not touched after the madvise(),
+//   which would fault it straight back in.
+static void slab_release(struct slab *slab)
+{
+    slab->magic = 0;
+    madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+
+    pthread_mutex_lock(&slab_lock);
+    slab_free_index[slab_free_count++] = ((char *)slab - slab_base) / SLAB_SIZE;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+static int slab_owns(void *ptr)
+{
+    char *base = __atomic_load_n(&slab_base, __ATOMIC_ACQUIRE);
+
+    return base != NULL && (char *)ptr >= base
+        && (char *)ptr < __atomic_load_n(&slab_top, __ATOMIC_ACQUIRE);
+}
+
+// The slab ptr is an object of, or NULL if ptr is not the start of an
+//   object in a live slab.
+static struct slab *slab_object(void *ptr)
+{
+    struct slab *slab = SLAB_OF(ptr);
+    size_t offset = (char *)ptr - (char *)slab;
+
+    if (slab->magic != SLAB_TAG(slab)
+        || offset < slab->first
+        || (offset - slab->first) % slab->size
+        || (offset - slab->first) / slab->size >= slab->count) {
+        return NULL;
+    }
+    return slab;
+}
+
+// Whether object ptr of slab is free, freed without the lock, or sitting
+//   in a CPU's cache. Read without the class lock, so slab_free() checks
+//   again once it holds it.
+static int slab_object_free(struct slab *slab, void *ptr)
+{
+    size_t i = ((char *)ptr - (char *)slab - slab->first) / slab->size;
+
+    return ((__atomic_load_n(&slab->free_map[i / 64], __ATOMIC_RELAXED)
+             | __atomic_load_n(&slab->remote_map[i / 64], __ATOMIC_RELAXED)
+             | __atomic_load_n(&slab->cached_map[i / 64], __ATOMIC_RELAXED))
+            & (1UL << (i % 64))) != 0;
+}
+
+static void slab_free(void *ptr)
+{
+    struct slab *slab = slab_object(ptr);
+    struct slab_class *sc = NULL;
+    size_t i = 0;
+
+    if (slab == NULL) {
+        if (DEBUG) { diagnostic_message("beavfree: invalid address given"); }
+        return;
+    }
+    if (slab_object_free(slab, ptr)) {
+        if (DEBUG) { diagnostic_message("beavfree: block already free"); }
+        return;
+    }
+    sc = &slab_classes[slab->size / ALIGNMENT - 1];
+    i = ((char *)ptr - (char *)slab - slab->first) / slab->size;
+
+    if (!REMOTE_FREE) {
+        pthread_mutex_lock(&sc->lock);
+    }
+    else if (pthread_mutex_trylock(&sc->lock) != 0) {
+        slab_remote_free(sc, slab, i);
+        return;
+    }
+    if ((slab->free_map[i / 64] | __atomic_load_n(&slab->cached_map[i / 64], __ATOMIC_RELAXED))
+        & (1UL << (i % 64))) {
+        pthread_mutex_unlock(&sc->lock);
+        if (DEBUG) { diagnostic_message("beavfree: block already free"); }
+        return;
+    }
+    stats_used(NULL, -slab->size, -1);
+    slab_mark_free(sc, slab, i);
+    if (__atomic_load_n(&sc->remote, __ATOMIC_RELAXED) != NULL) {
+        slab_drain(sc);
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+
+// Mark object i free. A slab that fills up with free objects is let go
+//   of, unless it is the only one its class has room in, and TRUE is
+//   returned: the slab must not be touched after that. The caller holds
+//   the class lock.
+static int slab_mark_free(struct slab_class *sc, struct slab *slab, size_t i)
+{
+    slab->free_map[i / 64] |= 1UL << (i % 64);
+    if (++slab->free == 1) {
+        slab_link(sc, slab);
+    }
+    else if (slab->free == slab->count && (sc->partial != slab || slab->next != NULL)) {
+        slab_unlink(sc, slab);
+        slab_release(slab);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// Free object i without the class lock. The first object set in the
+//   slab's remote map since it was last drained puts the slab on the
+//   class's remote list.
+static void slab_remote_free(struct slab_class *sc, struct slab *slab, size_t i)
+{
+    uint64_t bit = 1UL << (i % 64);
+    struct slab *head = NULL;
+
+    if (__atomic_fetch_or(&slab->remote_map[i / 64], bit, __ATOMIC_RELAXED) & bit) {
+        if (DEBUG) { diagnostic_message("beavfree: block already free"); }
+        return;
+    }
+    stats_used(NULL, -slab->size, -1);
+    if (__atomic_fetch_add(&slab->remote_pending, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    head = __atomic_load_n(&sc->remote, __ATOMIC_RELAXED);
+    do {
+        slab->remote_next = head;
+    } while (!__atomic_compare_exchange_n(&sc->remote, &head, slab, TRUE
+                                          , __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Move the objects freed without the lock into their slabs' free maps.
+//   A slab's pending count is cleared before its map is taken, so an
+//   object freed in between puts the slab back on the list rather than
+//   being missed. The caller holds the class lock.
+static void slab_drain(struct slab_class *sc)
+{
+    struct slab *slab = __atomic_exchange_n(&sc->remote, NULL, __ATOMIC_ACQUIRE);
+
+    while (slab != NULL) {
+        struct slab *next = slab->remote_next;
+        uint64_t remote[SLAB_MAP_WORDS];
+        size_t size = slab->size;
+        size_t twice = 0;
+        uint8_t released = FALSE;
+        size_t word = 0;
+
+        // The whole map is taken first, as marking the last object free
+        //   can let the slab go, and then it is not ours to read.
+        __atomic_store_n(&slab->remote_pending, 0, __ATOMIC_SEQ_CST);
+        for (word = 0; word < SLAB_MAP_WORDS; word++) {
+            remote[word] = __atomic_exchange_n(&slab->remote_map[word], 0, __ATOMIC_ACQ_REL);
+        }
+        for (word = 0; word < SLAB_MAP_WORDS; word++) {
+            while (remote[word]) {
+                size_t i = word * 64 + __builtin_ctzl(remote[word]);
+
+                remote[word] &= remote[word] - 1;
+                if (released || (slab->free_map[i / 64] & (1UL << (i % 64)))) {
+                    // Freed both with and without the lock.
+                    twice++;
+                    continue;
+                }
+                released = slab_mark_free(sc, slab, i);
+            }
+        }
+        if (twice) {
+            stats_used(NULL, size * twice, twice);
+        }
+        slab = next;
+    }
+}
+
+static void *slab_realloc(void *ptr, size_t size)
+{
+    struct slab *slab = slab_object(ptr);
+    void *new_data = NULL;
+
+    if (slab == NULL) {
+        if (DEBUG) { diagnostic_message("beavrealloc: invalid address given"); }
+        return NULL;
+    }
+    if (slab_object_free(slab, ptr)) {
+        if (DEBUG) { diagnostic_message("beavrealloc: block is free"); }
+        return NULL;
+    }
+    if (size <= slab->size) {
+        return ptr;
+    }
+
+    new_data = beavalloc(size);
+    if (new_data != NULL) {
+        memcpy(new_data, ptr, slab->size);
+        trace_moved(ptr, size, new_data);
+        slab_free(ptr);
+    }
+    return new_data;
+}
+
+// The caller holds the class lock.
+static void slab_link(struct slab_class *sc, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = sc->partial;
+    if (sc->partial != NULL) {
+        sc->partial->prev = slab;
+    }
+    sc->partial = slab;
+}
+
+// The caller holds the class lock.
+static void slab_unlink(struct slab_class *sc, struct slab *slab)
+{
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        sc->partial = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Drop every slab and give all of the committed slab space back.
+static void slab_reset(void)
+{
+    size_t i = 0;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_lock(&slab_classes[i].lock);
+    }
+    pthread_mutex_lock(&slab_lock);
+    if (slab_commit != slab_base) {
+        mmap(slab_base, slab_commit - slab_base, PROT_NONE
+             , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        stats_mapped(NULL, -(slab_commit - slab_base));
+    }
+    __atomic_store_n(&slab_top, slab_base, __ATOMIC_RELEASE);
+    slab_commit = slab_base;
+    slab_free_count = 0;
+    pthread_mutex_unlock(&slab_lock);
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        slab_classes[i].partial = NULL;
+        slab_classes[i].remote = NULL;
+        pthread_mutex_unlock(&slab_classes[i].lock);
+    }
+}
+
+// Give the block a mapping of its own, rounded up to whole pages.
+static void *mmap_alloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = 0;
+    struct mmap_block *m = NULL;
+
+    if (size > SIZE_MAX - sizeof(struct mmap_block) - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    length = (size + sizeof(struct mmap_block) + page - 1) & ~(page - 1);
+    m = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    if (m == MAP_FAILED) {
+        if (DEBUG) { diagnostic_message("failed to map memory"); }
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    m->lead = 0;
+    m->block.magic = BLOCK_TAG(&m->block);
+    m->block.flags = BLOCK_USED | BLOCK_MMAPPED;
+    m->block.capacity = length - sizeof(struct mmap_block);
+
+    pthread_mutex_lock(&mmap_lock);
+    if (!mmap_link(m)) {
+        pthread_mutex_unlock(&mmap_lock);
+        munmap(m, length);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_unlock(&mmap_lock);
+    zeroed_data = BLOCK_DATA(&m->block);
+    stats_mapped(NULL, length);
+    stats_used(NULL, m->block.capacity, 1);
+
+    if (DEBUG) { diagnostic_message("block mapped!"); }
+    return BLOCK_DATA(&m->block);
+}
+
+// Map enough to place the data on the alignment wherever the mapping
+//   lands, then unmap the whole pages before the header and after the data.
+static void *mmap_alloc_aligned(size_t alignment, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t length = 0;
+    char *base = NULL;
+    char *start = NULL;
+    char *end = NULL;
+    uintptr_t data = 0;
+    struct mmap_block *m = NULL;
+
+    if (size > SIZE_MAX - sizeof(struct mmap_block) - alignment - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    length = (size + sizeof(struct mmap_block) + alignment + page - 1) & ~(page - 1);
+    base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    if (base == MAP_FAILED) {
+        if (DEBUG) { diagnostic_message("failed to map memory"); }
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    data = ((uintptr_t)base + sizeof(struct mmap_block) + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    m = MMAP_BLOCK((struct block *)data - 1);
+    start = (char *)((uintptr_t)m & ~(uintptr_t)(page - 1));
+    end = (char *)((data + size + page - 1) & ~(uintptr_t)(page - 1));
+    if (start > base) {
+        munmap(base, start - base);
+        __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    }
+    if (end < base + length) {
+        munmap(end, base + length - end);
+        __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    }
+
+    m->lead = (char *)m - start;
+    m->block.magic = BLOCK_TAG(&m->block);
+    m->block.flags = BLOCK_USED | BLOCK_MMAPPED;
+    m->block.capacity = (char *)end - (char *)data;
+
+    pthread_mutex_lock(&mmap_lock);
+    if (!mmap_link(m)) {
+        pthread_mutex_unlock(&mmap_lock);
+        munmap(start, end - start);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_unlock(&mmap_lock);
+    zeroed_data = (void *)data;
+    stats_mapped(NULL, end - start);
+    stats_used(NULL, m->block.capacity, 1);
+
+    if (DEBUG) { diagnostic_message("aligned block mapped!"); }
+    return (void *)data;
+}
+
+// Grow a mapped block with mremap(), which moves the pages rather than
+//   copying them if the mapping cannot grow where it is.
+static void *mmap_realloc(struct block *curr, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct mmap_block *m = MMAP_BLOCK(curr);
+    struct mmap_block *new = NULL;
+    size_t old_capacity = curr->capacity;
+    size_t lead = m->lead;
+    size_t length = 0;
+    char *start = NULL;
+
+    if (size > SIZE_MAX - sizeof(struct mmap_block) - lead - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    length = (lead + size + sizeof(struct mmap_block) + page - 1) & ~(page - 1);
+
+    // Unlinking m first leaves room, so linking either block back in
+    //   cannot fail.
+    pthread_mutex_lock(&mmap_lock);
+    mmap_unlink(m);
+    start = mremap(MMAP_START(m), MMAP_LENGTH(m), length, MREMAP_MAYMOVE);
+    __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    if (start == MAP_FAILED) {
+        mmap_link(m);
+        pthread_mutex_unlock(&mmap_lock);
+        if (DEBUG) { diagnostic_message("failed to remap memory"); }
+        errno = ENOMEM;
+        return NULL;
+    }
+    new = (struct mmap_block *)(start + lead);
+    new->block.magic = BLOCK_TAG(&new->block);
+    new->block.capacity = length - lead - sizeof(struct mmap_block);
+    mmap_link(new);
+    // Another thread can only be handed the old range once it takes
+    //   mmap_lock, so it is recorded after this.
+    trace_moved(BLOCK_DATA(curr), size, BLOCK_DATA(&new->block));
+    pthread_mutex_unlock(&mmap_lock);
+    stats_mapped(NULL, new->block.capacity - old_capacity);
+    stats_used(NULL, new->block.capacity - old_capacity, 0);
+
+    return BLOCK_DATA(&new->block);
+}
+
+// Unmap the whole pages past size bytes. Shrinking never moves a mapping.
+static void mmap_shrink(struct block *curr, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    struct mmap_block *m = MMAP_BLOCK(curr);
+    size_t length = MMAP_LENGTH(m);
+    size_t new_length = (m->lead + size + sizeof(struct mmap_block) + page - 1) & ~(page - 1);
+    int shrunk = FALSE;
+
+    pthread_mutex_lock(&mmap_lock);
+    if (new_length < length
+        && mremap(MMAP_START(m), length, new_length, 0) != MAP_FAILED) {
+        curr->capacity = new_length - m->lead - sizeof(struct mmap_block);
+        shrunk = TRUE;
+    }
+    pthread_mutex_unlock(&mmap_lock);
+
+    if (shrunk) {
+        __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+        stats_mapped(NULL, -(length - new_length));
+        stats_used(NULL, -(length - new_length), 0);
+    }
+}
+
+static void mmap_free(struct block *curr)
+{
+    struct mmap_block *m = MMAP_BLOCK(curr);
+    void *start = MMAP_START(m);
+    size_t length = MMAP_LENGTH(m);
+
+    pthread_mutex_lock(&mmap_lock);
+    mmap_unlink(m);
+    pthread_mutex_unlock(&mmap_lock);
+
+    stats_used(NULL, -curr->capacity, -1);
+    stats_mapped(NULL, -length);
+    __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    munmap(start, length);
+}
+
+// Tell whether curr heads a mapped block. Nothing is read through curr
+//   until its header has been found among the live mappings, so a freed
+//   or foreign pointer is turned away safely.
+static struct block *mmap_find(struct block *curr)
+{
+    struct mmap_block *m = MMAP_BLOCK(curr);
+    int found = FALSE;
+
+    pthread_mutex_lock(&mmap_lock);
+    found = mmap_table != NULL && *mmap_slot(m) == m;
+    pthread_mutex_unlock(&mmap_lock);
+    return found ? curr : NULL;
+}
+
+// Add m to the list and the table, growing the table first if need be.
+//   Fails only if the table is full and cannot grow. The caller holds
+//   mmap_lock.
+static int mmap_link(struct mmap_block *m)
+{
+    if ((mmap_table_used + 1) * 4 > mmap_table_size * 3) {
+        mmap_table_grow();
+    }
+    if (mmap_table_used == mmap_table_size) {
+        return FALSE;
+    }
+    *mmap_slot(m) = m;
+    mmap_table_used++;
+
+    m->prev = NULL;
+    m->next = mmap_blocks;
+    if (mmap_blocks != NULL) {
+        mmap_blocks->prev = m;
+    }
+    mmap_blocks = m;
+    return TRUE;
+}
+
+// Take m off the list and out of the table, moving back the headers after
+//   it that would otherwise no longer be found. The caller holds mmap_lock.
+static void mmap_unlink(struct mmap_block *m)
+{
+    size_t mask = mmap_table_size - 1;
+    size_t hole = mmap_slot(m) - mmap_table;
+    size_t i = hole;
+
+    mmap_table[hole] = NULL;
+    mmap_table_used--;
+    for (;;) {
+        size_t home = 0;
+
+        i = (i + 1) & mask;
+        if (mmap_table[i] == NULL) {
+            break;
+        }
+        home = ((uintptr_t)mmap_table[i] * 0x9e3779b97f4a7c15ULL >> 24) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            mmap_table[hole] = mmap_table[i];
+            mmap_table[i] = NULL;
+            hole = i;
+        }
+    }
+
+    if (m->prev != NULL) {
+        m->prev->next = m->next;
+    }
+    else {
+        mmap_blocks = m->next;
+    }
+    if (m->next != NULL) {
+        m->next->prev = m->prev;
+    }
+}
+
+// The slot holding m, or else the empty slot it would go in. The table
+//   always has an empty slot. The caller holds mmap_lock.
+static struct mmap_block **mmap_slot(struct mmap_block *m)
+{
+    size_t mask = mmap_table_size - 1;
+    size_t i = ((uintptr_t)m * 0x9e3779b97f4a7c15ULL >> 24) & mask;
+
+    while (mmap_table[i] != NULL && mmap_table[i] != m) {
+        i = (i + 1) & mask;
+    }
+    return &mmap_table[i];
+}
+
+// Double the table, or make it. A table that cannot grow is left as it
+//   is. The caller holds mmap_lock.
+static void mmap_table_grow(void)
+{
+    struct mmap_block **old = mmap_table;
+    size_t old_size = mmap_table_size;
+    size_t size = old_size ? old_size * 2 : MMAP_TABLE_MIN;
+    struct mmap_block **table = mmap(NULL, size * sizeof(*table), PROT_READ | PROT_WRITE
+                                     , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t i = 0;
+
+    if (table == MAP_FAILED) {
+        return;
+    }
+    mmap_table = table;
+    mmap_table_size = size;
+    for (i = 0; i < old_size; i++) {
+        if (old[i] != NULL) {
+            *mmap_slot(old[i]) = old[i];
+        }
+    }
+    if (old != NULL) {
+        munmap(old, old_size * sizeof(*old));
+    }
+}
+
+// Allocate straight from an arena's heap. The caller holds the arena lock.
+static void *heap_alloc(struct beavalloc_arena *arena, size_t size)
+{
+    return heap_alloc_room(arena, size, 0);
+}
+
+// Allocate from a free block with room bytes to spare if there is one,
+//   leaving them free just past the block for it to grow into. The free
+//   block at the top of the heap always has room, but a block that grows
+//   into it is trimmed away and grown back again each time it is freed,
+//   so it is left to the best fit. The caller holds the arena lock.
+static void *heap_alloc_room(struct beavalloc_arena *arena, size_t size, size_t room)
+{
+    void *data = NULL;
+    struct block *curr = NULL;
+
+    if (arena->lower_mem_bound == NULL) {
+        if (DEBUG) { diagnostic_message("beavalloc: base memory location set"); }
+        __atomic_store_n(&arena->lower_mem_bound, sbrk(0), __ATOMIC_RELEASE);
+    }
+    if (__atomic_load_n(&arena->remote_free, __ATOMIC_RELAXED) != NULL) {
+        remote_drain(arena);
+    }
+    if (!room && MAX(ALIGN_SIZE(size), MIN_CAPACITY) <= FAST_MAX) {
+        data = fast_alloc(arena, size);
+        if (data != NULL) {
+            return data;
+        }
+    }
+
+    if (room) {
+        curr = find_free_block(arena, size + room);
+        if (curr != NULL && BLOCK_NEXT(curr) == arena->heap.tail) {
+            curr = NULL;
+        }
+    }
+    if (curr == NULL) {
+        curr = find_free_block(arena, size);
+    }
+    if (curr == NULL && arena->fast_bytes && MAX(ALIGN_SIZE(size), MIN_CAPACITY) > FAST_MAX) {
+        fast_consolidate(arena);
+        curr = find_free_block(arena, size);
+    }
+    if (curr != NULL) {
+        data = get_free_block(arena, curr, size);
+    }
+    else {
+        data = make_block(arena, size);
+    }
+
+    return data;
+}
+
+static void *make_block(struct beavalloc_arena *arena, size_t size)
+{
+    size_t pad = -(uintptr_t)arena_top(arena) & (ALIGNMENT - 1);
+    size_t needed = MAX(ALIGN_SIZE(size), MIN_CAPACITY);
+    size_t bytes = arena_grow_bytes(arena, determine_needed_bytes(size));
+    char *new = arena_more_core(arena, pad + bytes);
+    struct block *curr = NULL;
+
+    if (DEBUG) { diagnostic_message("making new block..."); }
+
+    if (new == (void *)-1) {
+        if (DEBUG) { diagnostic_message("failed to allocate memory"); }
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    curr = initialize_new_block(arena, new + pad, bytes);
+    __atomic_store_n(&arena->upper_mem_bound, BLOCK_DATA(arena->heap.tail), __ATOMIC_RELEASE);
+
+    // Whatever the request does not need goes back on the free list, so
+    //   blocks keep the capacity of the size they were asked for. Only
+    //   the partial page the core starts on can have been written before.
+    curr->flags |= BLOCK_ZEROED;
+    if (curr->capacity - needed >= META_DATA + MIN_CAPACITY) {
+        split_free_block(arena, curr, needed);
+    }
+    curr->flags &= ~BLOCK_ZEROED;
+    zeroed_data = BLOCK_DATA(curr);
+
+    if (DEBUG) { diagnostic_message("new block made!"); }
+    return BLOCK_DATA(curr);
+}
+
+static size_t determine_needed_bytes(size_t size)
+{
+    size_t remainder = (MAX(ALIGN_SIZE(size), MIN_CAPACITY) + 2 * META_DATA) % MIN_MEM;
+    size_t multiplier = (MAX(ALIGN_SIZE(size), MIN_CAPACITY) + 2 * META_DATA) / MIN_MEM;
+    if (remainder) {
+        multiplier++;
+    }
+
+    if (DEBUG) { diagnostic_message("determing number of bytes required..."); }
+
+    return MIN_MEM * multiplier;
+}
+
+// How far to grow the heap for bytes, and the step after this one. The
+//   caller holds the arena lock.
+static size_t arena_grow_bytes(struct beavalloc_arena *arena, size_t bytes)
+{
+    size_t min = __atomic_load_n(&grow_min, __ATOMIC_RELAXED);
+    size_t max = __atomic_load_n(&grow_max, __ATOMIC_RELAXED);
+    size_t step = MIN(MAX(arena->grow, min), max);
+
+    arena->grow = MIN(step * 2, max);
+    return MAX(bytes, step);
+}
+
+// Turn fresh core into a block at the top of the heap. When the memory
+//   carries straight on from the tail sentinel the sentinel becomes the
+//   new block's header. If someone else moved the break in between, the
+//   old sentinel is stretched into a fence over their memory.
+static struct block *initialize_new_block(struct beavalloc_arena *arena, void *new, size_t bytes)
+{
+    struct heap_bounds *heap = &arena->heap;
+    struct block *curr = NULL;
+
+    if (DEBUG) { diagnostic_message("initializing new block..."); }
+
+    if (heap->tail == NULL) {
+        curr = heap->head = new;
+        curr->flags = 0;
+        bytes -= META_DATA;
+    }
+    else if (new == BLOCK_DATA(heap->tail)) {
+        curr = heap->tail;
+    }
+    else {
+        heap->tail->capacity = (char *)new - (char *)BLOCK_DATA(heap->tail);
+        heap->tail->flags |= BLOCK_FENCE;
+        curr = new;
+        curr->flags = 0;
+        bytes -= META_DATA;
+    }
+
+    // Room for the new tail sentinel comes out of the new memory.
+    curr->magic = BLOCK_TAG(curr);
+    curr->flags |= BLOCK_USED;
+    curr->capacity = bytes - META_DATA;
+
+    heap->tail = BLOCK_NEXT(curr);
+    heap->tail->magic = 0;
+    heap->tail->flags = BLOCK_USED;
+    heap->tail->capacity = 0;
+
+    return curr;
+}
+
+// Map a block capacity onto its size class.
+static size_t bin_index(size_t size)
+{
+    size_t log2 = 0;
+
+    if (size < BIN_LINEAR_MAX) {
+        return size / ALIGNMENT;
+    }
+    log2 = (sizeof(size_t) * 8 - 1) - __builtin_clzl(size);
+    return (log2 - 5) * BIN_SUBCLASSES + ((size >> (log2 - 2)) & (BIN_SUBCLASSES - 1));
+}
+
+static void bin_insert(struct beavalloc_arena *arena, struct block *curr)
+{
+    size_t i = bin_index(curr->capacity);
+
+    arena->stats.free += curr->capacity;
+    arena->stats.free_blocks++;
+    if (ADDRESS_ORDER) {
+        list_insert(arena, curr);
+        return;
+    }
+    if (IN_TREE(curr)) {
+        tree_insert(&arena->bins[i], curr);
+    }
+    else {
+        FREE_LINKS(curr)->prev = NULL;
+        FREE_LINKS(curr)->next = arena->bins[i];
+        if (arena->bins[i] != NULL) {
+            FREE_LINKS(arena->bins[i])->prev = curr;
+        }
+        arena->bins[i] = curr;
+    }
+    arena->bin_map[i / 64] |= 1UL << (i % 64);
+}
+
+static void bin_remove(struct beavalloc_arena *arena, struct block *curr)
+{
+    size_t i = bin_index(curr->capacity);
+    struct free_links *links = FREE_LINKS(curr);
+
+    arena->stats.free -= curr->capacity;
+    arena->stats.free_blocks--;
+    if (ADDRESS_ORDER) {
+        list_remove(arena, curr);
+        return;
+    }
+    if (IN_TREE(curr)) {
+        tree_remove(&arena->bins[i], curr);
+    }
+    else {
+        if (links->prev != NULL) {
+            FREE_LINKS(links->prev)->next = links->next;
+        }
+        else {
+            arena->bins[i] = links->next;
+        }
+        if (links->next != NULL) {
+            FREE_LINKS(links->next)->prev = links->prev;
+        }
+    }
+    if (arena->bins[i] == NULL) {
+        arena->bin_map[i / 64] &= ~(1UL << (i % 64));
+    }
+}
+
+// Link curr in after the last free block below it. The list is walked
+//   to find the spot, which is what keeping address order costs.
+static void list_insert(struct beavalloc_arena *arena, struct block *curr)
+{
+    struct block *prev = NULL;
+    struct block *next = arena->free_list;
+
+    while (next != NULL && next < curr) {
+        prev = next;
+        next = FREE_LINKS(next)->next;
+    }
+    FREE_LINKS(curr)->prev = prev;
+    FREE_LINKS(curr)->next = next;
+    if (prev != NULL) {
+        FREE_LINKS(prev)->next = curr;
+    }
+    else {
+        arena->free_list = curr;
+    }
+    if (next != NULL) {
+        FREE_LINKS(next)->prev = curr;
+    }
+}
+
+// A rover that leaves the list falls back to the block before it, so
+//   the search still starts where the taken block was.
+static void list_remove(struct beavalloc_arena *arena, struct block *curr)
+{
+    struct free_links *links = FREE_LINKS(curr);
+
+    if (arena->rover == curr) {
+        arena->rover = links->prev;
+    }
+    if (links->prev != NULL) {
+        FREE_LINKS(links->prev)->next = links->next;
+    }
+    else {
+        arena->free_list = links->next;
+    }
+    if (links->next != NULL) {
+        FREE_LINKS(links->next)->prev = links->prev;
+    }
+}
+
+// The first block from from up to to that holds needed bytes.
+static struct block *list_fit(struct block *from, struct block *to, size_t needed)
+{
+    struct block *curr = NULL;
+
+    for (curr = from; curr != to; curr = FREE_LINKS(curr)->next) {
+        if (curr->capacity >= needed) {
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+// First fit searches from the bottom of the heap. Next fit searches on
+//   from the rover to the end and then wraps around, and leaves the rover
+//   on the block it found.
+static struct block *list_find(struct beavalloc_arena *arena, size_t needed)
+{
+    struct block *start = arena->free_list;
+    struct block *curr = NULL;
+
+    if (POLICY == POLICY_FIRST_FIT) {
+        return list_fit(start, NULL, needed);
+    }
+    if (arena->rover != NULL) {
+        start = FREE_LINKS(arena->rover)->next;
+    }
+    curr = list_fit(start, NULL, needed);
+    if (curr == NULL) {
+        curr = list_fit(arena->free_list, start, needed);
+    }
+    if (curr != NULL) {
+        arena->rover = curr;
+    }
+    return curr;
+}
+
+// Order blocks by capacity, then address, so every key is distinct.
+static int tree_before(struct block *a, struct block *b)
+{
+    return a->capacity < b->capacity || (a->capacity == b->capacity && a < b);
+}
+
+static uint32_t tree_priority(struct block *curr)
+{
+    return (uint32_t)(((uintptr_t)curr * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+// Walk down to where curr's priority puts it and split the subtree found
+//   there around curr's key into its two children.
+static void tree_insert(struct block **root, struct block *curr)
+{
+    uint32_t priority = tree_priority(curr);
+    struct block *parent = NULL;
+    struct block **link = root;
+    struct block *left_parent = curr;
+    struct block *right_parent = curr;
+    struct block **left = &FREE_TREE(curr)->left;
+    struct block **right = &FREE_TREE(curr)->right;
+    struct block *node = NULL;
+
+    while (*link != NULL && tree_priority(*link) > priority) {
+        parent = *link;
+        link = tree_before(curr, parent) ? &FREE_TREE(parent)->left : &FREE_TREE(parent)->right;
+    }
+    node = *link;
+    while (node != NULL) {
+        if (tree_before(node, curr)) {
+            *left = node;
+            FREE_TREE(node)->parent = left_parent;
+            left_parent = node;
+            left = &FREE_TREE(node)->right;
+            node = *left;
+        }
+        else {
+            *right = node;
+            FREE_TREE(node)->parent = right_parent;
+            right_parent = node;
+            right = &FREE_TREE(node)->left;
+            node = *right;
+        }
+    }
+    *left = NULL;
+    *right = NULL;
+    *link = curr;
+    FREE_TREE(curr)->parent = parent;
+}
+
+// Rotate curr down below whichever child has the higher priority until
+//   it has at most one child to take its place.
+static void tree_remove(struct block **root, struct block *curr)
+{
+    struct block *parent = FREE_TREE(curr)->parent;
+    struct block **link = root;
+
+    if (parent != NULL) {
+        link = FREE_TREE(parent)->left == curr ? &FREE_TREE(parent)->left : &FREE_TREE(parent)->right;
+    }
+    for (;;) {
+        struct block *left = FREE_TREE(curr)->left;
+        struct block *right = FREE_TREE(curr)->right;
+        struct block *up = NULL;
+
+        if (left == NULL || right == NULL) {
+            up = left != NULL ? left : right;
+            *link = up;
+            if (up != NULL) {
+                FREE_TREE(up)->parent = parent;
+            }
+            break;
+        }
+        if (tree_priority(left) > tree_priority(right)) {
+            up = left;
+            FREE_TREE(curr)->left = FREE_TREE(up)->right;
+            if (FREE_TREE(curr)->left != NULL) {
+                FREE_TREE(FREE_TREE(curr)->left)->parent = curr;
+            }
+            FREE_TREE(up)->right = curr;
+            *link = up;
+            link = &FREE_TREE(up)->right;
+        }
+        else {
+            up = right;
+            FREE_TREE(curr)->right = FREE_TREE(up)->left;
+            if (FREE_TREE(curr)->right != NULL) {
+                FREE_TREE(FREE_TREE(curr)->right)->parent = curr;
+            }
+            FREE_TREE(up)->left = curr;
+            *link = up;
+            link = &FREE_TREE(up)->left;
+        }
+        FREE_TREE(up)->parent = parent;
+        parent = up;
+    }
+}
+
+// The smallest block that holds needed bytes, the lowest of equals.
+static struct block *tree_best_fit(struct block *root, size_t needed)
+{
+    struct block *node = root;
+    struct block *best = NULL;
+
+    while (node != NULL) {
+        if (node->capacity >= needed) {
+            best = node;
+            node = FREE_TREE(node)->left;
+        }
+        else {
+            node = FREE_TREE(node)->right;
+        }
+    }
+    return best;
+}
+
+// The caller holds the arena lock.
+static int tree_purge(struct block *curr)
+{
+    if (curr == NULL) {
+        return 0;
+    }
+    return purge_block(curr) | tree_purge(FREE_TREE(curr)->left) | tree_purge(FREE_TREE(curr)->right);
+}
+
+// Every block in a bin above the request's own size class is big enough,
+//   so the bitmap gives a fit without looking at the blocks themselves;
+//   from a tree the smallest is taken. A request's own list is only
+//   scanned when nothing larger is free, but its own tree is searched
+//   first, for the best fit in the class.
+static struct block *find_free_block(struct beavalloc_arena *arena, size_t size)
+{
+    size_t needed = MAX(ALIGN_SIZE(size), MIN_CAPACITY);
+    size_t i = bin_index(needed);
+    size_t word = 0;
+    struct block *curr = arena->bins[i];
+
+    if (ADDRESS_ORDER) {
+        return list_find(arena, needed);
+    }
+    if (curr != NULL && IN_TREE(curr)) {
+        curr = tree_best_fit(curr, needed);
+        if (curr != NULL) {
+            return curr;
+        }
+    }
+    else if (curr != NULL && curr->capacity >= needed) {
+        return curr;
+    }
+    for (word = (i + 1) / 64; word < BIN_WORDS; word++) {
+        uint64_t bits = arena->bin_map[word];
+
+        if (word == (i + 1) / 64) {
+            bits &= ~0UL << ((i + 1) % 64);
+        }
+        if (bits) {
+            if (DEBUG) { diagnostic_message("free block exists!"); }
+            curr = arena->bins[word * 64 + __builtin_ctzl(bits)];
+            return IN_TREE(curr) ? tree_best_fit(curr, needed) : curr;
+        }
+    }
+    if (BEST_FIT && needed >= TREE_MIN) {
+        return NULL;
+    }
+    for (curr = arena->bins[i]; curr != NULL; curr = FREE_LINKS(curr)->next) {
+        if (curr->capacity >= needed) {
+            if (DEBUG) { diagnostic_message("free block exists!"); }
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+static void *get_free_block(struct beavalloc_arena *arena, struct block *curr, size_t size)
+{
+    size_t needed = MAX(ALIGN_SIZE(size), MIN_CAPACITY);
+
+    bin_remove(arena, curr);
+    mark_used(curr);
+
+    // If enough extra memory for another block, split into another free block.
+    if (curr->capacity - needed >= META_DATA + MIN_CAPACITY) {
+        split_free_block(arena, curr, needed);
+    }
+    if (curr->flags & BLOCK_ZEROED) {
+        curr->flags &= ~BLOCK_ZEROED;
+        zeroed_data = BLOCK_DATA(curr);
+    }
+
+    return BLOCK_DATA(curr);
+}
+
+static void mark_free(struct block *curr)
+{
+    curr->magic = FREE_TAG(curr);
+    curr->flags &= ~BLOCK_USED;
+    BLOCK_FOOTER(curr) = curr->capacity;
+    BLOCK_NEXT(curr)->flags |= BLOCK_PREV_FREE;
+}
+
+static void mark_used(struct block *curr)
+{
+    curr->magic = BLOCK_TAG(curr);
+    curr->flags |= BLOCK_USED;
+    BLOCK_NEXT(curr)->flags &= ~BLOCK_PREV_FREE;
+}
+
+// Carve the space past the first size bytes of curr off into a free block.
+//   Its header and links land outside the pages it inherits as zero.
+static void split_free_block(struct beavalloc_arena *arena, struct block *curr, size_t size)
+{
+    struct block *new_block = (struct block *)((char *)BLOCK_DATA(curr) + size);
+
+    new_block->flags = curr->flags & BLOCK_ZEROED;
+    new_block->capacity = curr->capacity - size - META_DATA;
+    curr->capacity = size;
+
+    mark_free(new_block);
+    bin_insert(arena, new_block);
+    arena->stats.splits++;
+
+    if (DEBUG) { diagnostic_message("free block split!"); }
+}
+
+// The header sits immediately before the data. Anything outside every
+//   arena's heap, not mapped by us, or misaligned is not one of ours;
+//   callers check the magic to see what state the block is in. The owning
+//   arena goes in *owner, NULL for a mapped block.
+static struct block *block_from_ptr(void *ptr, struct beavalloc_arena **owner)
+{
+    struct block *curr = (struct block *)ptr - 1;
+    uint count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    uint i = 0;
+
+    if ((uintptr_t)ptr % ALIGNMENT) {
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        struct beavalloc_arena *arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+        void *lower = NULL;
+
+        if (arena == NULL) {
+            continue;
+        }
+        lower = __atomic_load_n(&arena->lower_mem_bound, __ATOMIC_ACQUIRE);
+        if (lower != NULL
+            && (void *)curr >= lower
+            && ptr < __atomic_load_n(&arena->upper_mem_bound, __ATOMIC_ACQUIRE)) {
+            *owner = arena;
+            return curr;
+        }
+    }
+    *owner = NULL;
+    return mmap_find(curr);
+}
+
+void beavfree(void *ptr)
+{
+    struct beavalloc_arena *arena = NULL;
+    struct block *curr = NULL;
+
+    if (trace_fd >= 0 && !trace_nested) {
+        trace_call(TRACE_FREE, ptr, 0, 0);
+        return;
+    }
+    if (ptr == NULL) {
+        if (DEBUG) { diagnostic_message("beavfree: NULL pointer passed"); }
+        return;
+    }
+
+    if (slab_owns(ptr)) {
+        if (!CPU_CACHE || !cpu_cache_free_object(ptr)) {
+            slab_free(ptr);
+        }
+        return;
+    }
+
+    curr = block_from_ptr(ptr, &arena);
+    if (curr == NULL) {
+        if (DEBUG) { diagnostic_message("beavfree: invalid address given"); }
+        return;
+    }
+    if (curr->magic != BLOCK_TAG(curr)) {
+        if (curr->magic == FREE_TAG(curr) || curr->magic == CACHED_TAG(curr)) {
+            if (DEBUG) { diagnostic_message("beavfree: block already free"); }
+        }
+        else {
+            if (DEBUG) { diagnostic_message("beavfree: invalid address given"); }
+        }
+        return;
+    }
+
+    if (DEBUG) { diagnostic_message("beavfree: memory block freed!"); }
+
+    if (curr->flags & BLOCK_SAMPLED) {
+        prof_free(arena, curr);
+    }
+    if (curr->flags & BLOCK_MMAPPED) {
+        mmap_free(curr);
+        return;
+    }
+
+    // A user arena can be destroyed at any time, so its blocks are never
+    //   left sitting in a thread's or a CPU's cache.
+    if (CPU_CACHE && !(arena->flags & ARENA_USER) && curr->capacity <= TCACHE_MAX
+        && cpu_cache_free_block(curr)) {
+        return;
+    }
+    if (THREAD_CACHE && !tcache_exited && !(arena->flags & ARENA_USER)
+        && curr->capacity <= TCACHE_MAX) {
+        tcache_free(curr);
+        return;
+    }
+    if (REMOTE_FREE && arena != thread_arena && !(arena->flags & ARENA_USER)) {
+        stats_used(arena, -curr->capacity, -1);
+        curr->magic = CACHED_TAG(curr);
+        remote_push(arena, curr, curr, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    stats_used(arena, -curr->capacity, -1);
+    fast_free(arena, curr);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// Give a block back to its arena's heap. The caller holds the arena lock.
+static void heap_free(struct beavalloc_arena *arena, struct block *curr)
+{
+    arena->dirty += curr->capacity;
+    arena->decay_freed[arena->decay_epoch] += curr->capacity;
+    curr = coalesce_blocks(arena, curr);
+    curr->flags &= ~BLOCK_ZEROED;
+    mark_free(curr);
+    bin_insert(arena, curr);
+
+    if (trim_threshold && !__atomic_load_n(&decay_ms, __ATOMIC_RELAXED)
+        && curr->capacity >= trim_threshold) {
+        if (BLOCK_NEXT(curr) != arena->heap.tail || !arena_trim(arena, 0)) {
+            purge_block(curr);
+        }
+    }
+}
+
+// Put a freed block on its fast bin, or give it back to the heap if it
+//   is too big for one. See FAST_MAX. The caller holds the arena lock.
+static void fast_free(struct beavalloc_arena *arena, struct block *curr)
+{
+    size_t i = curr->capacity / ALIGNMENT;
+
+    if (!FAST_BINS || curr->capacity > FAST_MAX) {
+        heap_free(arena, curr);
+        return;
+    }
+    curr->magic = CACHED_TAG(curr);
+    *(struct block **)BLOCK_DATA(curr) = arena->fast[i];
+    arena->fast[i] = curr;
+    arena->fast_bytes += curr->capacity;
+    arena->stats.free += curr->capacity;
+    arena->stats.free_blocks++;
+    if (arena->fast_bytes > FAST_LIMIT) {
+        fast_consolidate(arena);
+    }
+}
+
+// The last block freed onto the fast bin of the request's size, or NULL
+//   if there is none. The caller holds the arena lock.
+static void *fast_alloc(struct beavalloc_arena *arena, size_t size)
+{
+    size_t i = MAX(ALIGN_SIZE(size), MIN_CAPACITY) / ALIGNMENT;
+    struct block *curr = arena->fast[i];
+
+    if (curr == NULL) {
+        return NULL;
+    }
+    arena->fast[i] = *(struct block **)BLOCK_DATA(curr);
+    arena->fast_bytes -= curr->capacity;
+    arena->stats.free -= curr->capacity;
+    arena->stats.free_blocks--;
+    curr->magic = BLOCK_TAG(curr);
+    return BLOCK_DATA(curr);
+}
+
+// Free every block on the fast bins for real, merging each with its free
+//   neighbours. The caller holds the arena lock.
+static void fast_consolidate(struct beavalloc_arena *arena)
+{
+    size_t i = 0;
+
+    if (arena->fast_bytes == 0) {
+        return;
+    }
+    for (i = 0; i < FAST_CLASSES; i++) {
+        struct block *curr = arena->fast[i];
+
+        arena->fast[i] = NULL;
+        while (curr != NULL) {
+            struct block *next = *(struct block **)BLOCK_DATA(curr);
+
+            arena->stats.free -= curr->capacity;
+            arena->stats.free_blocks--;
+            heap_free(arena, curr);
+            curr = next;
+        }
+    }
+    arena->fast_bytes = 0;
+    if (DEBUG) { diagnostic_message("fast bins consolidated"); }
+}
+
+// Grow curr where it stands, taking in a free right neighbour and, at the
+//   top of the heap, fresh core. Returns 0 if the block has to move. The
+//   caller holds the arena lock.
+static int heap_grow(struct beavalloc_arena *arena, struct block *curr, size_t size)
+{
+    size_t needed = MAX(ALIGN_SIZE(size), MIN_CAPACITY);
+    struct block *next = BLOCK_NEXT(curr);
+    struct block *tail = arena->heap.tail;
+    struct block *more = NULL;
+    size_t avail = curr->capacity;
+    size_t bytes = 0;
+    char *new = NULL;
+
+    if (!(next->flags & BLOCK_USED)) {
+        avail += next->capacity + META_DATA;
+        next = BLOCK_NEXT(next);
+    }
+    if (avail < needed) {
+        if (next != tail || arena_top(arena) != BLOCK_DATA(tail)) {
+            return FALSE;
+        }
+        bytes = arena_grow_bytes(arena, (needed - avail + MIN_MEM - 1) & ~((size_t)MIN_MEM - 1));
+        new = arena_more_core(arena, bytes);
+        if (new == (void *)-1) {
+            return FALSE;
+        }
+        more = initialize_new_block(arena, new, bytes);
+        __atomic_store_n(&arena->upper_mem_bound, BLOCK_DATA(arena->heap.tail), __ATOMIC_RELEASE);
+        if (more != tail) {
+            // Someone moved the break after all; keep the core for later.
+            heap_free(arena, more);
+            return FALSE;
+        }
+    }
+
+    if (!(BLOCK_NEXT(curr)->flags & BLOCK_USED)) {
+        coalesce_right(arena, curr);
+    }
+    if (more != NULL) {
+        curr->capacity += more->capacity + META_DATA;
+    }
+    BLOCK_NEXT(curr)->flags &= ~BLOCK_PREV_FREE;
+
+    if (curr->capacity - needed >= META_DATA + MIN_CAPACITY) {
+        split_free_block(arena, curr, needed);
+    }
+
+    if (DEBUG) { diagnostic_message("block grown in place!"); }
+    return TRUE;
+}
+
+static int grow_in_place(struct beavalloc_arena *arena, struct block *curr, size_t size)
+{
+    size_t old_capacity = curr->capacity;
+    int grown = FALSE;
+
+    pthread_mutex_lock(&arena->lock);
+    grown = heap_grow(arena, curr, size);
+    if (grown) {
+        stats_used(arena, curr->capacity - old_capacity, 0);
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return grown;
+}
+
+// Cut curr down to size and free what is left over, which joins a free
+//   right neighbour and is trimmed like any other free block. The caller
+//   holds the arena lock.
+static void heap_shrink(struct beavalloc_arena *arena, struct block *curr, size_t size)
+{
+    size_t needed = MAX(ALIGN_SIZE(size), MIN_CAPACITY);
+    struct block *rest = NULL;
+
+    if (curr->capacity - needed < META_DATA + MIN_CAPACITY) {
+        return;
+    }
+    rest = (struct block *)((char *)BLOCK_DATA(curr) + needed);
+    rest->magic = BLOCK_TAG(rest);
+    rest->flags = BLOCK_USED;
+    rest->capacity = curr->capacity - needed - META_DATA;
+    curr->capacity = needed;
+    arena->stats.splits++;
+    heap_free(arena, rest);
+
+    if (DEBUG) { diagnostic_message("block shrunk!"); }
+}
+
+// Allocate enough to find an aligned spot with room for a block of
+//   slack in front of it, then free the slack and the leftover tail. The
+//   caller holds the arena lock.
+static void *heap_alloc_aligned(struct beavalloc_arena *arena, size_t alignment, size_t size)
+{
+    struct block *curr = NULL;
+    struct block *aligned = NULL;
+    uintptr_t data = 0;
+
+    if (size > SIZE_MAX - alignment - META_DATA - MIN_CAPACITY) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    data = (uintptr_t)heap_alloc(arena, size + alignment + META_DATA + MIN_CAPACITY);
+    if (data == 0) {
+        return NULL;
+    }
+    curr = (struct block *)data - 1;
+    if ((data & (alignment - 1)) == 0) {
+        heap_shrink(arena, curr, size);
+        return (void *)data;
+    }
+
+    aligned = (struct block *)((data + META_DATA + MIN_CAPACITY + alignment - 1) & ~(alignment - 1)) - 1;
+    aligned->magic = BLOCK_TAG(aligned);
+    aligned->flags = BLOCK_USED;
+    aligned->capacity = (char *)BLOCK_NEXT(curr) - (char *)BLOCK_DATA(aligned);
+    curr->capacity = (char *)aligned - (char *)BLOCK_DATA(curr);
+    arena->stats.splits++;
+    heap_free(arena, curr);
+    heap_shrink(arena, aligned, size);
+
+    return BLOCK_DATA(aligned);
+}
+
+static void tcache_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// Runs as a thread exits, handing everything it cached back to the heap,
+//   and when the cache is turned off, with a NULL arg. An exiting thread
+//   never caches again: its later calls, from other destructors, go
+//   straight to the arena, as nothing would flush the cache a second time.
+static void tcache_destroy(void *arg)
+{
+    struct thread_cache *tc = tcache_get();
+    size_t i = 0;
+
+    for (i = 0; i < TCACHE_CLASSES; i++) {
+        if (tc->count[i]) {
+            tcache_flush(tc, i, tc->count[i]);
+        }
+    }
+    tc->active = FALSE;
+    if (arg != NULL) {
+        tcache_exited = TRUE;
+    }
+}
+
+// The calling thread's cache, emptied first if the heap was reset since
+//   it was last used.
+static struct thread_cache *tcache_get(void)
+{
+    uint64_t generation = __atomic_load_n(&heap_generation, __ATOMIC_ACQUIRE);
+
+    if (!tcache.active) {
+        pthread_once(&tcache_once, tcache_init);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.active = TRUE;
+        tcache.generation = generation;
+    }
+    if (tcache.generation != generation) {
+        stats_cached(-tstats.cached);
+        memset(tcache.head, 0, sizeof(tcache.head));
+        memset(tcache.count, 0, sizeof(tcache.count));
+        memset(tcache.batch, 0, sizeof(tcache.batch));
+        tcache.generation = generation;
+    }
+    return &tcache;
+}
+
+static void *tcache_alloc(size_t size)
+{
+    struct thread_cache *tc = tcache_get();
+    size_t i = MAX(ALIGN_SIZE(size), MIN_CAPACITY) / ALIGNMENT;
+    struct block *curr = NULL;
+    void *data = tc->head[i];
+
+    if (data == NULL) {
+        tcache_refill(tc, size);
+        data = tc->head[i];
+        if (data == NULL) {
+            return NULL;
+        }
+    }
+
+    tc->head[i] = *(void **)data;
+    tc->count[i]--;
+    curr = (struct block *)data - 1;
+    curr->magic = BLOCK_TAG(curr);
+    stats_cached(-curr->capacity);
+    stats_used(NULL, curr->capacity, 1);
+    return data;
+}
+
+// Pull several blocks of this size out of the thread's arena under one
+//   lock. The batch starts at one block and doubles each time the class
+//   runs dry, so sizes used only once or twice do not strand memory in
+//   the cache.
+static void tcache_refill(struct thread_cache *tc, size_t size)
+{
+    struct beavalloc_arena *arena = arena_get();
+    size_t i = MAX(ALIGN_SIZE(size), MIN_CAPACITY) / ALIGNMENT;
+    uint batch = MIN(MAX(tc->batch[i] * 2, 1), TCACHE_BATCH);
+    uint k = 0;
+
+    tc->batch[i] = batch;
+    pthread_mutex_lock(&arena->lock);
+    for (k = 0; k < batch; k++) {
+        void *data = heap_alloc(arena, size);
+        struct block *curr = NULL;
+        size_t j = 0;
+
+        if (data == NULL) {
+            break;
+        }
+        curr = (struct block *)data - 1;
+        j = curr->capacity / ALIGNMENT;
+        if (k == 0) {
+            j = i;
+        }
+        if (j >= TCACHE_CLASSES || tc->count[j] >= TCACHE_COUNT) {
+            heap_free(arena, curr);
+            continue;
+        }
+        *(void **)data = tc->head[j];
+        tc->head[j] = data;
+        tc->count[j]++;
+        curr->magic = CACHED_TAG(curr);
+        stats_cached(curr->capacity);
+    }
+    pthread_mutex_unlock(&arena->lock);
+}
+
+static void tcache_push(struct thread_cache *tc, struct block *curr)
+{
+    size_t i = curr->capacity / ALIGNMENT;
+    void *data = BLOCK_DATA(curr);
+
+    curr->magic = CACHED_TAG(curr);
+    *(void **)data = tc->head[i];
+    tc->head[i] = data;
+    tc->count[i]++;
+    stats_cached(curr->capacity);
+}
+
+static void tcache_free(struct block *curr)
+{
+    struct thread_cache *tc = tcache_get();
+    size_t i = curr->capacity / ALIGNMENT;
+
+    stats_used(NULL, -curr->capacity, -1);
+    if (tc->count[i] >= TCACHE_COUNT) {
+        tcache_flush(tc, i, TCACHE_COUNT / 2);
+    }
+    tcache_push(tc, curr);
+}
+
+// Hand the most recently cached count blocks of class i back to their
+//   arenas. Neighbouring blocks nearly always share an arena, so a lock
+//   is only swapped when the next block belongs somewhere else. Blocks of
+//   another thread's arena are chained up and pushed to it in one go.
+static void tcache_flush(struct thread_cache *tc, size_t i, uint count)
+{
+    struct beavalloc_arena *locked = NULL;
+    struct beavalloc_arena *remote = NULL;
+    struct block *first = NULL;
+    struct block *last = NULL;
+    uint chained = 0;
+
+    while (count-- && tc->head[i] != NULL) {
+        void *data = tc->head[i];
+        struct beavalloc_arena *arena = NULL;
+        struct block *curr = block_from_ptr(data, &arena);
+
+        tc->head[i] = *(void **)data;
+        tc->count[i]--;
+        stats_cached(-curr->capacity);
+        if (REMOTE_FREE && arena != thread_arena) {
+            if (arena != remote && chained) {
+                remote_push(remote, first, last, chained);
+                chained = 0;
+            }
+            if (chained) {
+                *(struct block **)BLOCK_DATA(last) = curr;
+            }
+            else {
+                first = curr;
+            }
+            remote = arena;
+            last = curr;
+            chained++;
+            continue;
+        }
+        if (arena != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            locked = arena;
+            pthread_mutex_lock(&locked->lock);
+        }
+        fast_free(arena, curr);
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    if (chained) {
+        remote_push(remote, first, last, chained);
+    }
+}
+
+// Map a cache for every CPU the system is configured with, if glibc
+//   registered an rseq area for the thread. Nothing is mapped when it did
+//   not, and the caches stay off.
+static void cpu_cache_init(void)
+{
+#ifdef HAVE_RSEQ
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    void *caches = NULL;
+
+    if (__rseq_size == 0 || cpus <= 0) {
+        return;
+    }
+    caches = mmap(NULL, cpus * sizeof(struct cpu_cache), PROT_READ | PROT_WRITE
+                  , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    __atomic_add_fetch(&mmap_calls, 1, __ATOMIC_RELAXED);
+    if (caches == MAP_FAILED) {
+        if (DEBUG) { diagnostic_message("failed to map the per-CPU caches"); }
+        return;
+    }
+    cpu_count = cpus;
+    cpu_caches = caches;
+#endif // HAVE_RSEQ
+}
+
+#ifdef HAVE_RSEQ
+
+# define RSEQ_STR_(_x)   #_x
+# define RSEQ_STR(_x)    RSEQ_STR_(_x)
+
+// The thread's rseq area, at a fixed offset from its thread pointer.
+# define RSEQ_AREA()     ((struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset))
+
+// Opens a restartable sequence that runs from label 1 to label 2. The
+//   descriptor tells the kernel where the sequence is, and a thread
+//   preempted, signalled or moved to another CPU inside it is sent to
+//   label 4, which jumps to _abort. The kernel checks for the signature
+//   just ahead of label 4 before it jumps there. The last store before
+//   label 2 is the one that commits.
+# define RSEQ_START(_abort)                                      \
+    ".pushsection __rseq_cs, \"aw\"\n\t"                        \
+    ".balign 32\n\t"                                            \
+    "3:\n\t"                                                    \
+    ".long 0, 0\n\t"                                            \
+    ".quad 1f, 2f - 1f, 4f\n\t"                                 \
+    ".popsection\n\t"                                           \
+    ".pushsection __rseq_failure, \"ax\"\n\t"                   \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                                \
+    ".long " RSEQ_STR(RSEQ_SIG) "\n\t"                          \
+    "4:\n\t"                                                    \
+    "jmp %l[" #_abort "]\n\t"                                   \
+    ".popsection\n\t"                                           \
+    "leaq 3b(%%rip), %%rax\n\t"                                 \
+    "movq %%rax, %c[cs](%[rs])\n\t"
+
+// Take the last object off class i of the CPU's cache. The CPU is read
+//   inside the sequence, so the class the object comes off is always the
+//   current CPU's. Returns FALSE if the class is empty or the thread has
+//   no rseq area.
+static int cpu_cache_pop(size_t i, void **data)
+{
+    struct rseq *rs = RSEQ_AREA();
+
+    if (__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) >= cpu_count) {
+        return FALSE;
+    }
+    for ( ; ; ) {
+        __asm__ __volatile__ goto (
+            RSEQ_START(restart)
+            "1:\n\t"
+            "movl %c[cpu](%[rs]), %%eax\n\t"
+            "imulq %[stride], %%rax\n\t"
+            "addq %[class], %%rax\n\t"
+            "movq (%%rax), %%rcx\n\t"
+            "testq %%rcx, %%rcx\n\t"
+            "jz %l[empty]\n\t"
+            "movq (%%rax, %%rcx, 8), %%rdx\n\t"
+            "movq %%rdx, (%[data])\n\t"
+            "decq %%rcx\n\t"
+            "movq %%rcx, (%%rax)\n\t"
+            "2:\n\t"
+            :
+            : [rs] "r" (rs), [cs] "i" (offsetof(struct rseq, rseq_cs))
+              , [cpu] "i" (offsetof(struct rseq, cpu_id))
+              , [stride] "r" (sizeof(struct cpu_cache))
+              , [class] "r" (&cpu_caches->classes[i]), [data] "r" (data)
+            : "rax", "rcx", "rdx", "memory", "cc"
+            : restart, empty);
+        return TRUE;
+restart:
+        continue;
+    }
+empty:
+    return FALSE;
+}
+
+// Put data on class i of the CPU's cache. Returns FALSE if the class is
+//   full or the thread has no rseq area.
+static int cpu_cache_push(size_t i, void *data)
+{
+    struct rseq *rs = RSEQ_AREA();
+
+    if (__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED) >= cpu_count) {
+        return FALSE;
+    }
+    for ( ; ; ) {
+        __asm__ __volatile__ goto (
+            RSEQ_START(restart)
+            "1:\n\t"
+            "movl %c[cpu](%[rs]), %%eax\n\t"
+            "imulq %[stride], %%rax\n\t"
+            "addq %[class], %%rax\n\t"
+            "movq (%%rax), %%rcx\n\t"
+            "cmpq %[max], %%rcx\n\t"
+            "jae %l[full]\n\t"
+            "movq %[data], 8(%%rax, %%rcx, 8)\n\t"
+            "incq %%rcx\n\t"
+            "movq %%rcx, (%%rax)\n\t"
+            "2:\n\t"
+            :
+            : [rs] "r" (rs), [cs] "i" (offsetof(struct rseq, rseq_cs))
+              , [cpu] "i" (offsetof(struct rseq, cpu_id))
+              , [stride] "r" (sizeof(struct cpu_cache))
+              , [class] "r" (&cpu_caches->classes[i]), [data] "r" (data)
+              , [max] "i" (CPU_CACHE_COUNT)
+            : "rax", "rcx", "memory", "cc"
+            : restart, full);
+        return TRUE;
+restart:
+        continue;
+    }
+full:
+    return FALSE;
+}
+
+#else
+
+static int cpu_cache_pop(size_t i, void **data)
+{
+    (void) i;
+    (void) data;
+    return FALSE;
+}
+
+static int cpu_cache_push(size_t i, void *data)
+{
+    (void) i;
+    (void) data;
+    return FALSE;
+}
+
+#endif // HAVE_RSEQ
+
+// Reuse something freed on this CPU. A class of at most SLAB_MAX can
+//   hold slab objects as well as heap blocks, and a slab object smaller
+//   than MIN_CAPACITY has a class of its own.
+static void *cpu_cache_alloc(size_t size)
+{
+    size_t i = (SLABS && size <= SLAB_MAX ? ALIGN_SIZE(size) : MAX(ALIGN_SIZE(size), MIN_CAPACITY))
+        / ALIGNMENT;
+    void *data = NULL;
+
+    if (!cpu_cache_pop(i, &data)) {
+        return NULL;
+    }
+    if (slab_owns(data)) {
+        struct slab *slab = SLAB_OF(data);
+        size_t j = ((char *)data - (char *)slab - slab->first) / slab->size;
+
+        __atomic_and_fetch(&slab->cached_map[j / 64], ~(1UL << (j % 64)), __ATOMIC_RELAXED);
+        stats_cached(-slab->size);
+        stats_used(NULL, slab->size, 1);
+    }
+    else {
+        struct block *curr = (struct block *)data - 1;
+
+        curr->magic = BLOCK_TAG(curr);
+        stats_cached(-curr->capacity);
+        stats_used(NULL, curr->capacity, 1);
+    }
+    return data;
+}
+
+// Returns FALSE, with the block left as it was, if the CPU's class is
+//   full.
+static int cpu_cache_free_block(struct block *curr)
+{
+    curr->magic = CACHED_TAG(curr);
+    if (!cpu_cache_push(curr->capacity / ALIGNMENT, BLOCK_DATA(curr))) {
+        curr->magic = BLOCK_TAG(curr);
+        return FALSE;
+    }
+    stats_used(NULL, -curr->capacity, -1);
+    stats_cached(curr->capacity);
+    return TRUE;
+}
+
+// A slab object has no header to mark, so its bit in the slab's cached
+//   map is set while it sits in a CPU's cache. Returns FALSE, with the
+//   bit cleared again, if the CPU's class is full, or if ptr is not an
+//   object, for slab_free() to sort out.
+static int cpu_cache_free_object(void *ptr)
+{
+    struct slab *slab = slab_object(ptr);
+    size_t i = 0;
+    uint64_t bit = 0;
+
+    if (slab == NULL) {
+        return FALSE;
+    }
+    i = ((char *)ptr - (char *)slab - slab->first) / slab->size;
+    bit = 1UL << (i % 64);
+    if (((__atomic_load_n(&slab->free_map[i / 64], __ATOMIC_RELAXED)
+          | __atomic_load_n(&slab->remote_map[i / 64], __ATOMIC_RELAXED)) & bit)
+        || (__atomic_fetch_or(&slab->cached_map[i / 64], bit, __ATOMIC_RELAXED) & bit)) {
+        if (DEBUG) { diagnostic_message("beavfree: block already free"); }
+        return TRUE;
+    }
+    if (!cpu_cache_push(slab->size / ALIGNMENT, ptr)) {
+        __atomic_and_fetch(&slab->cached_map[i / 64], ~bit, __ATOMIC_RELAXED);
+        return FALSE;
+    }
+    stats_used(NULL, -slab->size, -1);
+    stats_cached(slab->size);
+    return TRUE;
+}
+
+// Merge curr with any free neighbours, pulling them out of their bins.
+//   Returns the block that now holds the combined space.
+static struct block *coalesce_blocks(struct beavalloc_arena *arena, struct block * curr)
+{
+    if (!(BLOCK_NEXT(curr)->flags & BLOCK_USED)) {                  // Coalesce right.
+        coalesce_right(arena, curr);
+    }
+    if (curr->flags & BLOCK_PREV_FREE) {                            // Coalesce left.
+        curr = coalesce_left(arena, curr);
+    }
+    return curr;
+}
+
+static void coalesce_right(struct beavalloc_arena *arena, struct block *curr)
+{
+    struct block *right = BLOCK_NEXT(curr);
+
+    if (DEBUG) { diagnostic_message("coalesce right..."); }
+    bin_remove(arena, right);
+    curr->capacity += right->capacity + META_DATA;
+    right->magic = 0;
+    arena->stats.coalesces++;
+}
+
+static struct block *coalesce_left(struct beavalloc_arena *arena, struct block *curr)
+{
+    struct block *left = (struct block *)((char *)curr - ((size_t *)curr)[-1] - META_DATA);
+
+    if (DEBUG) { diagnostic_message("coalesce left..."); }
+    bin_remove(arena, left);
+    left->capacity += curr->capacity + META_DATA;
+    curr->magic = 0;
+    arena->stats.coalesces++;
+    return left;
+}
+
+// The default arena goes back to where the break started, the other
+//   automatic arenas and the slabs give their committed pages back and
+//   mapped blocks are unmapped. Arenas made with beavalloc_arena_create() are left alone.
+void beavalloc_reset(void)
+{
+    uint i = 0;
+
+    pthread_mutex_lock(&arenas_lock);
+    for (i = 0; i < MAX_AUTO_ARENAS; i++) {
+        struct beavalloc_arena *arena = auto_arenas[i];
+
+        if (arena == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        if (arena->flags & ARENA_SBRK) {
+            if (arena->lower_mem_bound != NULL) {
+                brk(arena->lower_mem_bound);
+            }
+            __atomic_store_n(&arena->lower_mem_bound, NULL, __ATOMIC_RELEASE);
+            __atomic_store_n(&arena->upper_mem_bound, NULL, __ATOMIC_RELEASE);
+        }
+        else if (arena->commit_end != arena->lower_mem_bound) {
+            mmap(arena->lower_mem_bound
+                 , (char *)arena->commit_end - (char *)arena->lower_mem_bound
+                 , PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+            __atomic_store_n(&arena->upper_mem_bound, arena->lower_mem_bound, __ATOMIC_RELEASE);
+            arena->commit_end = arena->lower_mem_bound;
+        }
+        arena_clear(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    __atomic_add_fetch(&heap_generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&arenas_lock);
+
+    slab_reset();
+    if (cpu_caches != NULL) {
+        memset(cpu_caches, 0, cpu_count * sizeof(struct cpu_cache));
+    }
+
+    pthread_mutex_lock(&mmap_lock);
+    while (mmap_blocks != NULL) {
+        struct mmap_block *m = mmap_blocks;
+
+        mmap_blocks = m->next;
+        munmap(MMAP_START(m), MMAP_LENGTH(m));
+    }
+    if (mmap_table != NULL) {
+        memset(mmap_table, 0, mmap_table_size * sizeof(*mmap_table));
+    }
+    mmap_table_used = 0;
+    pthread_mutex_unlock(&mmap_lock);
+
+    stats_reset();
+    prof_reset();
+
+    if (DEBUG) { diagnostic_message("heap reset!"); }
+}
+
+void beavalloc_set_verbose(uint8_t v)
+{
+    DEBUG = v;
+}
+
+void beavalloc_set_trim_threshold(size_t threshold)
+{
+    trim_threshold = threshold;
+}
+
+void beavalloc_set_mmap_threshold(size_t threshold)
+{
+    mmap_threshold = threshold;
+}
+
+int beavalloc_set_decay(size_t ms)
+{
+    pthread_mutex_lock(&decay_lock);
+    __atomic_store_n(&decay_ms, ms, __ATOMIC_RELAXED);
+    if (ms && !decay_running) {
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&decay_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        if (pthread_create(&decay_thread, NULL, decay_main, NULL) != 0) {
+            __atomic_store_n(&decay_ms, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&decay_lock);
+            if (DEBUG) { diagnostic_message("failed to start the purge thread"); }
+            return -1;
+        }
+        decay_running = TRUE;
+    }
+    else if (!ms && decay_running) {
+        pthread_cond_signal(&decay_cond);
+        pthread_mutex_unlock(&decay_lock);
+        pthread_join(decay_thread, NULL);
+        pthread_mutex_lock(&decay_lock);
+        pthread_cond_destroy(&decay_cond);
+        decay_running = FALSE;
+    }
+    else if (decay_running) {
+        pthread_cond_signal(&decay_cond);
+    }
+    pthread_mutex_unlock(&decay_lock);
+    return 0;
+}
+
+void beavalloc_set_growth(size_t min, size_t max)
+{
+    min = MAX((min + MIN_MEM - 1) & ~((size_t)MIN_MEM - 1), MIN_MEM);
+    max = MAX((max + MIN_MEM - 1) & ~((size_t)MIN_MEM - 1), min);
+    __atomic_store_n(&grow_min, min, __ATOMIC_RELAXED);
+    __atomic_store_n(&grow_max, max, __ATOMIC_RELAXED);
+}
+
+int beavalloc_set_cpu_cache(uint8_t v)
+{
+    if (v) {
+        pthread_once(&cpu_cache_once, cpu_cache_init);
+    }
+    CPU_CACHE = v && cpu_caches != NULL;
+    return CPU_CACHE;
+}
+
+void beavalloc_set_slabs(uint8_t v)
+{
+    SLABS = v;
+}
+
+void beavalloc_set_fast_bins(uint8_t v)
+{
+    uint count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    uint i = 0;
+
+    FAST_BINS = v;
+    if (v) {
+        return;
+    }
+    pthread_mutex_lock(&arenas_lock);
+    for (i = 0; i < count; i++) {
+        struct beavalloc_arena *arena = arenas[i];
+
+        if (arena == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&arena->lock);
+        fast_consolidate(arena);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+void beavalloc_set_remote_free(uint8_t v)
+{
+    REMOTE_FREE = v;
+}
+
+void beavalloc_set_thread_cache(uint8_t v)
+{
+    if (!v && THREAD_CACHE && tcache.active) {
+        tcache_destroy(NULL);
+    }
+    THREAD_CACHE = v;
+}
+
+void *beavcalloc(size_t nmemb, size_t size)
+{
+    void *data = NULL;
+    size_t total = 0;
+
+    if (trace_fd >= 0 && !trace_nested) {
+        return trace_call(TRACE_CALLOC, NULL, nmemb, size);
+    }
+    if (nmemb == 0 || size == 0)
+        return NULL;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        if (DEBUG) { diagnostic_message("beavcalloc: nmemb * size overflows"); }
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    zeroed_data = NULL;
+    data = beavalloc(total);
+    if (data != NULL) {
+        zero_block(data, total);
+    }
+    return data;
+}
+
+void *beavrealloc(void *ptr, size_t size)
+{
+    void *new_data = NULL;
+    struct beavalloc_arena *arena = NULL;
+    struct block *ptr_block = NULL;
+
+    if (trace_fd >= 0 && !trace_nested) {
+        return trace_call(TRACE_REALLOC, ptr, 0, size);
+    }
+    if (size == (size_t)NULL)
+        return NULL;
+
+    if (ptr == NULL) {
+        new_data = beavalloc(size * 2);
+    }
+    else if (slab_owns(ptr)) {
+        new_data = slab_realloc(ptr, size);
+    }
+    else {
+        ptr_block = block_from_ptr(ptr, &arena);                    // Find block that owns this data.
+
+        if (ptr_block == NULL || ptr_block->magic != BLOCK_TAG(ptr_block)) {
+            if (DEBUG) { diagnostic_message("beavrealloc: invalid address given"); }
+            return NULL;
+        }
+
+        if (ptr_block->capacity >= size) {  // Can just decrease used space.
+            if (DEBUG) { diagnostic_message("beavrealloc: decreasing used space of block..."); }
+            if (ptr_block->flags & BLOCK_MMAPPED) {
+                mmap_shrink(ptr_block, size);
+            }
+            else {
+                size_t old_capacity = ptr_block->capacity;
+                size_t tail = old_capacity - MAX(ALIGN_SIZE(size), MIN_CAPACITY);
+
+                if (tail >= old_capacity / SHRINK_FRACTION || tail >= SHRINK_PAGE) {
+                    pthread_mutex_lock(&arena->lock);
+                    heap_shrink(arena, ptr_block, size);
+                    stats_used(arena, -(old_capacity - ptr_block->capacity), 0);
+                    pthread_mutex_unlock(&arena->lock);
+                }
+            }
+            new_data = ptr;
+        }
+        else if (ptr_block->flags & BLOCK_MMAPPED) {
+            if (DEBUG) { diagnostic_message("beavrealloc: remapping block..."); }
+            new_data = mmap_realloc(ptr_block, size);
+            if (new_data != NULL && new_data != ptr
+                && (((struct block *)new_data - 1)->flags & BLOCK_SAMPLED)) {
+                prof_move(ptr, new_data);
+            }
+        }
+        else if (((arena->flags & ARENA_USER) || !mmap_threshold || size < mmap_threshold)
+                 && grow_in_place(arena, ptr_block, size)) {
+            if (DEBUG) { diagnostic_message("beavrealloc: block grown in place..."); }
+            new_data = ptr;
+        }
+        else {                              // Allocate new block.
+            if (DEBUG) { diagnostic_message("beavrealloc: allocating new block..."); }
+            if (arena->flags & ARENA_USER) {
+                new_data = beavalloc_arena_alloc(arena, size);
+            }
+            else if (BEST_FIT && size >= TREE_MIN && !prof_rate
+                     && !(mmap_threshold && size >= mmap_threshold)) {
+                // The best fit leaves a growing block nothing to grow into,
+                //   so look for half as much again to keep free past it.
+                new_data = heap_alloc_thread(size, size / 2);
+            }
+            else {
+                new_data = beavalloc(size);
+            }
+            if (new_data == NULL) {
+                return NULL;
+            }
+            memcpy(new_data, ptr, ptr_block->capacity);
+            trace_moved(ptr, size, new_data);
+            beavfree(ptr);
+        }
+
+    }
+
+    return new_data;
+}
+
+size_t beavalloc_usable_size(void *ptr)
+{
+    struct beavalloc_arena *arena = NULL;
+    struct block *curr = NULL;
+    struct slab *slab = NULL;
+
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (slab_owns(ptr)) {
+        slab = slab_object(ptr);
+        return slab != NULL ? slab->size : 0;
+    }
+    curr = block_from_ptr(ptr, &arena);
+    if (curr == NULL || curr->magic != BLOCK_TAG(curr)) {
+        return 0;
+    }
+    return curr->capacity;
+}
+
+// Locks are taken in the same order as everywhere else: the arena table,
+//   the arenas, the slab classes, the slab space, then the mapped blocks.
+//   The purge thread's lock is taken before any of them. Nothing is locked
+//   under trace_lock, so it is taken last.
+void beavalloc_atfork_prepare(void)
+{
+    uint i = 0;
+
+    pthread_mutex_lock(&decay_lock);
+    pthread_mutex_lock(&arenas_lock);
+    for (i = 0; i < num_arenas; i++) {
+        if (arenas[i] != NULL) {
+            pthread_mutex_lock(&arenas[i]->lock);
+        }
+    }
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_lock(&slab_classes[i].lock);
+    }
+    pthread_mutex_lock(&slab_lock);
+    pthread_mutex_lock(&mmap_lock);
+    pthread_mutex_lock(&stats_lock);
+    pthread_mutex_lock(&prof_lock);
+    pthread_mutex_lock(&trace_lock);
+}
+
+void beavalloc_atfork_parent(void)
+{
+    uint i = 0;
+
+    pthread_mutex_unlock(&trace_lock);
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&mmap_lock);
+    pthread_mutex_unlock(&slab_lock);
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_unlock(&slab_classes[i].lock);
+    }
+    for (i = 0; i < num_arenas; i++) {
+        if (arenas[i] != NULL) {
+            pthread_mutex_unlock(&arenas[i]->lock);
+        }
+    }
+    pthread_mutex_unlock(&arenas_lock);
+    pthread_mutex_unlock(&decay_lock);
+}
+
+// Only the forking thread lives on in the child and it holds every lock,
+//   so they can all be released the same way. The parent's trace stays the
+//   parent's: the child drops what it inherited unwritten.
+void beavalloc_atfork_child(void)
+{
+    struct thread_stats *ts = NULL;
+
+    if (trace_fd >= 0) {
+        close(trace_fd);
+        trace_fd = -1;
+        trace_len = 0;
+    }
+
+    // The other threads' counts stay behind as if they had exited.
+    for (ts = thread_stats_list; ts != NULL; ts = ts->next) {
+        if (ts != &tstats) {
+            retired_stats.in_use += ts->in_use;
+            retired_stats.used_blocks += ts->used_blocks;
+            retired_stats.cached += ts->cached;
+        }
+    }
+    thread_stats_list = NULL;
+    if (tstats.active) {
+        tstats.prev = tstats.next = NULL;
+        thread_stats_list = &tstats;
+    }
+
+    // Nor does the purge thread, so the child trims as it frees again.
+    if (decay_running) {
+        decay_running = FALSE;
+        __atomic_store_n(&decay_ms, 0, __ATOMIC_RELAXED);
+    }
+    beavalloc_atfork_parent();
+}
+
+int beavalloc_prof_start(size_t rate)
+{
+    pthread_mutex_lock(&prof_lock);
+    if (prof_buckets == NULL) {
+        void *buckets = mmap(NULL, PROF_BUCKETS * sizeof(struct prof_bucket), PROT_READ | PROT_WRITE
+                             , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        void *samples = mmap(NULL, PROF_SAMPLES * sizeof(struct prof_sample), PROT_READ | PROT_WRITE
+                             , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (buckets == MAP_FAILED || samples == MAP_FAILED) {
+            if (buckets != MAP_FAILED) {
+                munmap(buckets, PROF_BUCKETS * sizeof(struct prof_bucket));
+            }
+            if (samples != MAP_FAILED) {
+                munmap(samples, PROF_SAMPLES * sizeof(struct prof_sample));
+            }
+            pthread_mutex_unlock(&prof_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        prof_buckets = buckets;
+        prof_samples = samples;
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    // backtrace() loads the unwinder the first time, which allocates.
+    {
+        void *pcs[1];
+
+        tprof.busy = TRUE;
+        backtrace(pcs, 1);
+        tprof.busy = FALSE;
+    }
+    prof_last_rate = rate ? rate : PROF_RATE;
+    __atomic_store_n(&prof_rate, prof_last_rate, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void beavalloc_prof_stop(void)
+{
+    __atomic_store_n(&prof_rate, 0, __ATOMIC_RELEASE);
+}
+
+int beavalloc_prof_dump(const char *path, int format)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&prof_lock);
+    if (format == PROF_FOLDED) {
+        prof_write_folded(fd);
+    }
+    else {
+        prof_write_pprof(fd);
+    }
+    prof_flush(fd);
+    pthread_mutex_unlock(&prof_lock);
+    return close(fd);
+}
+
+int beavalloc_prof_signal(int signo, const char *path, int format)
+{
+    struct sigaction sa;
+
+    if (strlen(path) >= sizeof(prof_signal_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(prof_signal_path, path);
+    prof_signal_format = format;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = prof_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    return sigaction(signo, &sa, NULL);
+}
+
+static void prof_handler(int signo)
+{
+    (void) signo;
+    prof_dump_pending = 1;
+}
+
+// Count size against the thread's allowance. The allowances are drawn
+//   from an exponential distribution, so every byte allocated is equally
+//   likely to be the one that takes a sample.
+static int prof_due(size_t size)
+{
+    if (tprof.busy) {
+        return FALSE;
+    }
+    if (tprof.seed == 0) {
+        tprof.seed = ((uintptr_t)&tprof ^ trace_now()) | 1;
+        tprof.left = prof_next();
+    }
+    tprof.left -= size;
+    if (tprof.left > 0) {
+        return FALSE;
+    }
+    tprof.left = prof_next();
+    return TRUE;
+}
+
+static int64_t prof_next(void)
+{
+    double u = 0;
+
+    // xorshift64*
+    tprof.seed ^= tprof.seed >> 12;
+    tprof.seed ^= tprof.seed << 25;
+    tprof.seed ^= tprof.seed >> 27;
+    u = ((tprof.seed * 0x2545f4914f6cdd1dULL >> 11) + 1) * (1.0 / (1ULL << 53));
+    return (int64_t)(-log(u) * __atomic_load_n(&prof_rate, __ATOMIC_RELAXED)) + 1;
+}
+
+// Allocate a sampled block. It skips the slabs so it has a header for
+//   BLOCK_SAMPLED, and nothing allocated on the way is itself sampled.
+static void *prof_alloc(size_t size)
+{
+    void *data = NULL;
+
+    tprof.busy = TRUE;
+    if (prof_dump_pending) {
+        prof_dump_pending = 0;
+        beavalloc_prof_dump(prof_signal_path, prof_signal_format);
+    }
+    if (mmap_threshold && size >= mmap_threshold) {
+        data = mmap_alloc(size);
+    }
+    else if (THREAD_CACHE && !tcache_exited && MAX(ALIGN_SIZE(size), MIN_CAPACITY) <= TCACHE_MAX) {
+        data = tcache_alloc(size);
+    }
+    else {
+        data = heap_alloc_thread(size, 0);
+    }
+    if (data != NULL) {
+        prof_record(data, size, 3);
+    }
+    tprof.busy = FALSE;
+    return data;
+}
+
+// Take the stack, less the skip frames inside beavalloc, and file the
+//   block under it. Each sample stands for the bytes it would take on
+//   average to draw one sample of its size, size / (1 - e^(-size/rate)).
+static void prof_record(void *data, size_t size, uint skip)
+{
+    struct block *curr = (struct block *)data - 1;
+    struct beavalloc_arena *arena = NULL;
+    struct prof_bucket *bucket = NULL;
+    struct prof_sample *sample = NULL;
+    void *pcs[PROF_DEPTH + 3];
+    size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+    uint64_t estimate = 0;
+    int depth = 0;
+    uint8_t busy = tprof.busy;
 
-static uint8_t DEBUG = FALSE;
+    if (rate == 0) {
+        return;
+    }
+    tprof.busy = TRUE;
+    depth = backtrace(pcs, PROF_DEPTH + skip);
+    tprof.busy = busy;
+    if (depth <= (int)skip) {
+        return;
+    }
+    estimate = size / -expm1(-(double)size / rate);
 
-static void *make_block(size_t size);
-static size_t determine_needed_bytes(size_t size);
-static void initialize_new_block(struct block *new, size_t size, size_t bytes);
-static int free_block_exists(size_t size);
-static void *get_free_block(size_t size);
-static void split_free_block(struct block *curr, size_t size);
-static void coalesce_blocks(struct block *curr);
-static void coalesce_right(struct block *curr);
-static void coalesce_left(struct block *curr);
-static void diagnostic_message(const char *message);
+    pthread_mutex_lock(&prof_lock);
+    bucket = prof_bucket_get(pcs + skip, depth - skip);
+    sample = bucket != NULL ? prof_sample_slot(data) : NULL;
+    if (sample == NULL) {
+        pthread_mutex_unlock(&prof_lock);
+        return;
+    }
+    sample->ptr = data;
+    sample->size = size;
+    sample->estimate = estimate;
+    sample->bucket = bucket;
+    prof_num_samples++;
+    bucket->allocs++;
+    bucket->alloc_bytes += size;
+    bucket->live++;
+    bucket->live_bytes += size;
+    bucket->live_estimate += estimate;
+    pthread_mutex_unlock(&prof_lock);
 
-void *beavalloc(size_t size)
+    // Neighbours set BLOCK_PREV_FREE under the arena lock, so the flag
+    //   is only changed under it too.
+    block_from_ptr(data, &arena);
+    if (arena != NULL) {
+        pthread_mutex_lock(&arena->lock);
+    }
+    curr->flags |= BLOCK_SAMPLED;
+    if (arena != NULL) {
+        pthread_mutex_unlock(&arena->lock);
+    }
+}
+
+static void prof_free(struct beavalloc_arena *arena, struct block *curr)
 {
-    void *data = NULL;
-    if (size == (size_t)NULL) {
-        if (DEBUG) { diagnostic_message("beavalloc: size = NULL"); }
-        return NULL;
+    struct prof_sample *sample = NULL;
+
+    if (arena != NULL) {
+        pthread_mutex_lock(&arena->lock);
+    }
+    curr->flags &= ~BLOCK_SAMPLED;
+    if (arena != NULL) {
+        pthread_mutex_unlock(&arena->lock);
     }
 
-    if (lower_mem_bound == NULL) {
-        if (DEBUG) { diagnostic_message("beavalloc: base memory location set"); }
-        lower_mem_bound = sbrk(0);
+    pthread_mutex_lock(&prof_lock);
+    sample = prof_sample_slot(BLOCK_DATA(curr));
+    if (sample != NULL && sample->ptr == BLOCK_DATA(curr)) {
+        sample->bucket->live--;
+        sample->bucket->live_bytes -= sample->size;
+        sample->bucket->live_estimate -= sample->estimate;
+        prof_sample_remove(sample);
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// A sampled mapped block that mremap() moved.
+static void prof_move(void *old, void *new)
+{
+    struct prof_sample *sample = NULL;
+    struct prof_sample moved;
+
+    pthread_mutex_lock(&prof_lock);
+    sample = prof_sample_slot(old);
+    if (sample != NULL && sample->ptr == old) {
+        moved = *sample;
+        prof_sample_remove(sample);
+        sample = prof_sample_slot(new);
+        if (sample != NULL) {
+            *sample = moved;
+            sample->ptr = new;
+            prof_num_samples++;
+        }
     }
+    pthread_mutex_unlock(&prof_lock);
+}
 
-    if (free_block_exists(size)) {
-        data = get_free_block(size);
+// The bucket for a stack, made if it is new. NULL once the table is
+//   three quarters full. The caller holds prof_lock.
+static struct prof_bucket *prof_bucket_get(void **pcs, uint depth)
+{
+    uint64_t hash = depth;
+    size_t i = 0;
+
+    for (i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001b3ULL;
     }
-    else {
-        data = make_block(size);
+    for (i = hash & (PROF_BUCKETS - 1); prof_buckets[i].depth != 0; i = (i + 1) & (PROF_BUCKETS - 1)) {
+        if (prof_buckets[i].hash == hash && prof_buckets[i].depth == depth
+            && memcmp(prof_buckets[i].pcs, pcs, depth * sizeof(void *)) == 0) {
+            return &prof_buckets[i];
+        }
     }
+    if (prof_num_buckets >= PROF_BUCKETS * 3 / 4) {
+        return NULL;
+    }
+    prof_num_buckets++;
+    prof_buckets[i].hash = hash;
+    prof_buckets[i].depth = depth;
+    memcpy(prof_buckets[i].pcs, pcs, depth * sizeof(void *));
+    return &prof_buckets[i];
+}
 
-    return data;
+// The slot holding ptr, or else the empty slot it would go in. NULL if
+//   ptr is not there and the table is three quarters full. The caller
+//   holds prof_lock.
+static struct prof_sample *prof_sample_slot(void *ptr)
+{
+    size_t i = ((uintptr_t)ptr * 0x9e3779b97f4a7c15ULL >> 24) & (PROF_SAMPLES - 1);
+
+    while (prof_samples[i].ptr != NULL && prof_samples[i].ptr != ptr) {
+        i = (i + 1) & (PROF_SAMPLES - 1);
+    }
+    if (prof_samples[i].ptr == NULL && prof_num_samples >= PROF_SAMPLES * 3 / 4) {
+        return NULL;
+    }
+    return &prof_samples[i];
 }
 
-static void *make_block(size_t size)
+// Empty a slot, moving back the samples after it that would otherwise
+//   no longer be found. The caller holds prof_lock.
+static void prof_sample_remove(struct prof_sample *sample)
 {
-    size_t bytes = determine_needed_bytes(size);
-    struct block *new = sbrk(bytes);
+    size_t hole = sample - prof_samples;
+    size_t i = hole;
 
-    if (DEBUG) { diagnostic_message("making new block..."); }
+    prof_samples[hole].ptr = NULL;
+    prof_num_samples--;
+    for (;;) {
+        size_t home = 0;
 
-    if (new == (void *)-1) {
-        if (DEBUG) { diagnostic_message("failed to allocate memory"); }
-        errno = ENOMEM;
-        return NULL;
+        i = (i + 1) & (PROF_SAMPLES - 1);
+        if (prof_samples[i].ptr == NULL) {
+            break;
+        }
+        home = ((uintptr_t)prof_samples[i].ptr * 0x9e3779b97f4a7c15ULL >> 24) & (PROF_SAMPLES - 1);
+        if (((i - home) & (PROF_SAMPLES - 1)) >= ((i - hole) & (PROF_SAMPLES - 1))) {
+            prof_samples[hole] = prof_samples[i];
+            prof_samples[i].ptr = NULL;
+            hole = i;
+        }
     }
-    
-    upper_mem_bound = sbrk(0);
-    
-    initialize_new_block(new, size, bytes);
-    
-    if (DEBUG) { diagnostic_message("new block made!"); }
-    return new->data;
 }
 
-static size_t determine_needed_bytes(size_t size)
+// Every sampled block went with the heap; the stacks keep their totals.
+static void prof_reset(void)
 {
-    int remainder = (size + META_DATA) % MIN_MEM;
-    int multiplier = (size + META_DATA) / MIN_MEM;
-    if (remainder) {
-        multiplier++;
+    uint i = 0;
+
+    pthread_mutex_lock(&prof_lock);
+    if (prof_samples != NULL) {
+        madvise(prof_samples, PROF_SAMPLES * sizeof(struct prof_sample), MADV_DONTNEED);
+        for (i = 0; i < PROF_BUCKETS; i++) {
+            prof_buckets[i].live = 0;
+            prof_buckets[i].live_bytes = 0;
+            prof_buckets[i].live_estimate = 0;
+        }
+    }
+    prof_num_samples = 0;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// The legacy heap profile pprof reads: totals, one line per stack with
+//   live and all time counts, then the mappings to symbolize against.
+//   The caller holds prof_lock.
+static void prof_write_pprof(int fd)
+{
+    uint64_t live = 0;
+    uint64_t live_bytes = 0;
+    uint64_t allocs = 0;
+    uint64_t alloc_bytes = 0;
+    char buf[4096];
+    ssize_t n = 0;
+    int maps = -1;
+    uint i = 0;
+    uint j = 0;
+
+    for (i = 0; prof_buckets != NULL && i < PROF_BUCKETS; i++) {
+        live += prof_buckets[i].live;
+        live_bytes += prof_buckets[i].live_bytes;
+        allocs += prof_buckets[i].allocs;
+        alloc_bytes += prof_buckets[i].alloc_bytes;
     }
+    prof_put(fd, "heap profile: %lu: %lu [%lu: %lu] @ heap_v2/%zu\n"
+             , live, live_bytes, allocs, alloc_bytes, prof_last_rate);
+    for (i = 0; prof_buckets != NULL && i < PROF_BUCKETS; i++) {
+        struct prof_bucket *bucket = &prof_buckets[i];
 
-    if (DEBUG) { diagnostic_message("determing number of bytes required..."); }
-    
-    return MIN_MEM * multiplier;
+        if (bucket->depth == 0) {
+            continue;
+        }
+        prof_put(fd, "%lu: %lu [%lu: %lu] @", bucket->live, bucket->live_bytes
+                 , bucket->allocs, bucket->alloc_bytes);
+        for (j = 0; j < bucket->depth; j++) {
+            prof_put(fd, " %p", bucket->pcs[j]);
+        }
+        prof_put(fd, "\n");
+    }
+
+    prof_put(fd, "\nMAPPED_LIBRARIES:\n");
+    prof_flush(fd);
+    maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    while (maps >= 0 && (n = read(maps, buf, sizeof(buf))) > 0) {
+        if (write(fd, buf, n) != n) {
+            break;
+        }
+    }
+    if (maps >= 0) {
+        close(maps);
+    }
 }
 
-static void initialize_new_block(struct block *new, size_t size, size_t bytes)
+// One line per stack still holding memory, outermost frame first, with
+//   the live bytes its samples stand for. The caller holds prof_lock.
+static void prof_write_folded(int fd)
 {
-    if (DEBUG) { diagnostic_message("initializing new block..."); }
-    new->next = NULL;
-    new->free = FALSE;
-    new->size = size;
-    new->capacity = bytes - META_DATA;
+    char name[256];
+    uint i = 0;
+    int j = 0;
 
-    if (heap.head == NULL) {
-        new->prev = NULL;
-        heap.head = heap.tail = new;
+    for (i = 0; prof_buckets != NULL && i < PROF_BUCKETS; i++) {
+        struct prof_bucket *bucket = &prof_buckets[i];
+
+        if (bucket->live == 0) {
+            continue;
+        }
+        for (j = bucket->depth - 1; j >= 0; j--) {
+            prof_frame(bucket->pcs[j], name, sizeof(name));
+            prof_put(fd, "%s%s", name, j ? ";" : "");
+        }
+        prof_put(fd, " %lu\n", bucket->live_estimate);
+    }
+}
+
+// Name a return address by its symbol, else by its object and offset.
+static void prof_frame(void *pc, char *name, size_t len)
+{
+    Dl_info info;
+
+    if (dladdr(pc, &info) == 0 || info.dli_fname == NULL) {
+        snprintf(name, len, "%p", pc);
+    }
+    else if (info.dli_sname != NULL) {
+        snprintf(name, len, "%s", info.dli_sname);
     }
     else {
-        new->prev = heap.tail;
-        heap.tail->next = new;
-        heap.tail = new;
+        const char *base = strrchr(info.dli_fname, '/');
+
+        snprintf(name, len, "%s+%#lx", base ? base + 1 : info.dli_fname
+                 , (unsigned long)((char *)pc - (char *)info.dli_fbase));
     }
+}
+
+// Buffered output for the dumps, which cannot use stdio: it allocates.
+//   The caller holds prof_lock.
+static void prof_put(int fd, const char *fmt, ...)
+{
+    va_list ap;
+    int n = 0;
 
-    new->data = new + 1;
+    if (prof_out_len > sizeof(prof_out) - 512) {
+        prof_flush(fd);
+    }
+    va_start(ap, fmt);
+    n = vsnprintf(prof_out + prof_out_len, sizeof(prof_out) - prof_out_len, fmt, ap);
+    va_end(ap);
+    prof_out_len = MIN(prof_out_len + MAX(n, 0), sizeof(prof_out) - 1);
 }
 
-static int free_block_exists(size_t size)
+static void prof_flush(int fd)
 {
-    struct block *curr = heap.head;
-    while (curr != NULL) {
-        if (curr->free && (curr->capacity - size > 0)) {
-            if (DEBUG) { diagnostic_message("free block exists!"); }
-            return TRUE;
+    size_t done = 0;
+
+    while (done < prof_out_len) {
+        ssize_t n = write(fd, prof_out + done, prof_out_len - done);
+
+        if (n <= 0 && errno != EINTR) {
+            break;
         }
-        curr = curr->next;
+        done += MAX(n, 0);
     }
-    return FALSE;
+    prof_out_len = 0;
 }
 
-static void *get_free_block(size_t size)
+int beavalloc_trace_start(const char *path)
 {
-    struct block *curr = heap.head;
-    while (curr != NULL) {
-        if (curr->free && (curr->capacity - size > 0)) {
-            curr->free = FALSE;
-            curr->size = size;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
 
-            // If significant amount of extra memory, split into another free block.
-            if (curr->capacity - size > size) {
-                split_free_block(curr, size);
-            }
+    if (fd < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        pthread_mutex_unlock(&trace_lock);
+        close(fd);
+        errno = EBUSY;
+        return -1;
+    }
+    memcpy(trace_buf, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+    trace_len = sizeof(TRACE_MAGIC) - 1;
+    trace_time = trace_now();
+    trace_last_ptr = 0;
+    trace_fd = fd;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
 
-            return curr->data;
-        }
-        curr = curr->next;
+void beavalloc_trace_stop(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        trace_flush();
+        close(trace_fd);
+        trace_fd = -1;
     }
-    return NULL;
+    pthread_mutex_unlock(&trace_lock);
 }
 
-static void split_free_block(struct block *curr, size_t size)
+// Make a call with recording held off for the calls it makes in turn,
+//   then record it. A call that gives a block back is recorded before
+//   the block is let go of, so another thread that is handed the same
+//   address is always recorded after it. trace_lock is held only while
+//   a record is added, never across the call.
+static void *trace_call(uint op, void *ptr, size_t arg, size_t size)
 {
-    struct block *new_block = NULL;
-    char *block_finder = (char *)curr;
+    void *data = NULL;
+    int saved_errno = 0;
+    uint8_t moved = FALSE;
 
-    block_finder += META_DATA + size;
-    new_block = (struct block *)block_finder;
+    if (trace_thread == 0) {
+        trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    }
 
-    new_block->size = 0;
-    new_block->capacity = curr->capacity - size - META_DATA;
-    new_block->free = TRUE;
-    new_block->prev = curr;
-    new_block->next = curr->next;
-    new_block->data = new_block + 1;
+    trace_nested = TRUE;
+    switch (op) {
+    case TRACE_ALLOC:
+        data = beavalloc(size);
+        break;
+    case TRACE_FREE:
+        pthread_mutex_lock(&trace_lock);
+        trace_record(op, ptr, arg, size, NULL);
+        pthread_mutex_unlock(&trace_lock);
+        beavfree(ptr);
+        break;
+    case TRACE_CALLOC:
+        data = beavcalloc(arg, size);
+        break;
+    case TRACE_REALLOC:
+        // A realloc that moves the block records itself in trace_moved()
+        //   and clears trace_moving. Otherwise it is recorded below.
+        trace_moving = ptr;
+        data = beavrealloc(ptr, size);
+        moved = (ptr != NULL && trace_moving == NULL);
+        trace_moving = NULL;
+        break;
+    case TRACE_ALIGNED:
+        data = beavalloc_aligned(arg, size);
+        break;
+    }
+    trace_nested = FALSE;
 
-    curr->next = new_block;
-    curr->size = size;
-    curr->capacity = size;
+    saved_errno = errno;
+    if (op != TRACE_FREE && !moved) {
+        pthread_mutex_lock(&trace_lock);
+        trace_record(op, ptr, arg, size, data);
+        pthread_mutex_unlock(&trace_lock);
+    }
+    errno = saved_errno;
+    return data;
+}
 
-    if (new_block->next == NULL)
-        heap.tail = new_block;
+// Record a realloc that moved ptr to result, before ptr is let go of.
+//   Only the block trace_call() is reallocating is recorded here.
+static void trace_moved(void *ptr, size_t size, void *result)
+{
+    int saved_errno = errno;
 
-    if (DEBUG) { diagnostic_message("free block split!"); }
+    if (trace_moving != ptr) {
+        return;
+    }
+    trace_moving = NULL;
+    pthread_mutex_lock(&trace_lock);
+    trace_record(TRACE_REALLOC, ptr, 0, size, result);
+    pthread_mutex_unlock(&trace_lock);
+    errno = saved_errno;
 }
 
-void beavfree(void *ptr)
+// The time is taken under the lock so records go out in time order. The
+//   caller holds trace_lock.
+static void trace_record(uint op, void *ptr, size_t arg, size_t size, void *result)
 {
-    if (ptr == NULL) {
-        if (DEBUG) { diagnostic_message("beavfree: NULL pointer passed"); }
+    uint64_t now = 0;
+
+    if (trace_fd < 0) {
         return;
     }
-    else {
-        struct block *curr = heap.head;
-        while (curr != NULL) {
-            if (curr->data == ptr) {
-                curr->free = TRUE;
-                curr->size = 0;
+    if (trace_len + TRACE_RECORD > TRACE_BUFFER) {
+        trace_flush();
+    }
+    now = trace_now();
+    trace_buf[trace_len++] = op;
+    trace_put(trace_thread);
+    trace_put(now - trace_time);
+    trace_time = now;
+    switch (op) {
+    case TRACE_FREE:
+        trace_put_ptr((uintptr_t)ptr);
+        break;
+    case TRACE_REALLOC:
+        trace_put_ptr((uintptr_t)ptr);
+        trace_put(size);
+        trace_put_ptr((uintptr_t)result);
+        break;
+    case TRACE_CALLOC:
+    case TRACE_ALIGNED:
+        trace_put(arg);
+        // fall through
+    default:
+        trace_put(size);
+        trace_put_ptr((uintptr_t)result);
+        break;
+    }
+}
 
-                if (DEBUG) { diagnostic_message("beavfree: memory block freed!"); }
+// Write out the buffer. The caller holds trace_lock. A trace that cannot
+//   be written is stopped rather than left to fail on every call.
+static void trace_flush(void)
+{
+    size_t done = 0;
 
-                if ( ((curr->prev != NULL) && (curr->prev->free == TRUE)) || ((curr->next != NULL) && (curr->next->free == TRUE)) ) {
-                    if (DEBUG) { diagnostic_message("coalescing free blocks..."); }
-                    coalesce_blocks(curr);
-                }
-                return;
-            }
-            curr = curr->next;
+    while (done < trace_len) {
+        ssize_t n = write(trace_fd, trace_buf + done, trace_len - done);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
+        if (n <= 0) {
+            if (DEBUG) { diagnostic_message("beavalloc_trace: write failed, trace stopped"); }
+            close(trace_fd);
+            trace_fd = -1;
+            break;
+        }
+        done += n;
+    }
+    trace_len = 0;
+}
+
+static uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_put(uint64_t v)
+{
+    while (v >= 0x80) {
+        trace_buf[trace_len++] = (uint8_t)v | 0x80;
+        v >>= 7;
     }
+    trace_buf[trace_len++] = (uint8_t)v;
+}
+
+static void trace_put_ptr(uint64_t ptr)
+{
+    int64_t delta = (int64_t)(ptr - trace_last_ptr);
+
+    trace_put(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    trace_last_ptr = ptr;
 }
 
-static void coalesce_blocks(struct block * curr)
+int beavalloc_trace_read(FILE *in, struct beavalloc_trace_rec *rec)
 {
-    if ( (curr->prev != NULL && curr->prev->free == TRUE) && (curr->next != NULL && curr->next->free == TRUE) ) {   // Coalesce left and right.
-        coalesce_right(curr);
-        coalesce_left(curr);
+    uint64_t v = 0;
+    int op = 0;
+
+    if (rec->count == 0) {
+        char magic[sizeof(TRACE_MAGIC) - 1];
+
+        if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)
+            || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+            return -1;
+        }
     }
-    else if (curr->prev != NULL && curr->prev->free == TRUE) {                                                      // Coalesce left.
-        coalesce_left(curr);
+
+    op = getc_unlocked(in);
+    if (op == EOF) {
+        return 0;
+    }
+    rec->op = op;
+    rec->ptr = rec->arg = rec->size = rec->result = 0;
+    if (trace_get(in, &v) < 0) {
+        return -1;
     }
-    else if (curr->next != NULL && curr->next->free == TRUE) {                                                      // Coalesce right.
-        coalesce_right(curr);
+    rec->thread = v;
+    if (trace_get(in, &v) < 0) {
+        return -1;
+    }
+    rec->time += v;
+
+    switch (op) {
+    case TRACE_FREE:
+        if (trace_get_ptr(in, rec, &rec->ptr) < 0) {
+            return -1;
+        }
+        break;
+    case TRACE_REALLOC:
+        if (trace_get_ptr(in, rec, &rec->ptr) < 0) {
+            return -1;
+        }
+        if (trace_get(in, &rec->size) < 0 || trace_get_ptr(in, rec, &rec->result) < 0) {
+            return -1;
+        }
+        break;
+    case TRACE_CALLOC:
+    case TRACE_ALIGNED:
+        if (trace_get(in, &rec->arg) < 0) {
+            return -1;
+        }
+        // fall through
+    case TRACE_ALLOC:
+        if (trace_get(in, &rec->size) < 0 || trace_get_ptr(in, rec, &rec->result) < 0) {
+            return -1;
+        }
+        break;
+    default:
+        return -1;
     }
+    rec->count++;
+    return 1;
 }
 
-static void coalesce_right(struct block *curr)
+static int trace_get(FILE *in, uint64_t *v)
 {
-    if (DEBUG) { diagnostic_message("coalesce right..."); }
-    if (curr->next->next == NULL) {
-        heap.tail = curr;
+    uint shift = 0;
+    int c = 0;
+
+    *v = 0;
+    do {
+        c = getc_unlocked(in);
+        if (c == EOF || shift > 63) {
+            return -1;
+        }
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+static int trace_get_ptr(FILE *in, struct beavalloc_trace_rec *rec, uint64_t *ptr)
+{
+    uint64_t v = 0;
+
+    if (trace_get(in, &v) < 0) {
+        return -1;
     }
-    else {
-        curr->next->next->prev = curr;
+    *ptr = rec->last_ptr + ((v >> 1) ^ -(v & 1));
+    rec->last_ptr = *ptr;
+    return 0;
+}
+
+void beavalloc_stats(struct beavalloc_stats *stats)
+{
+    uint count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    int64_t in_use = 0;
+    int64_t used_blocks = 0;
+    int64_t cached = 0;
+    struct thread_stats *ts = NULL;
+    uint i = 0;
+
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&stats_lock);
+    in_use = retired_stats.in_use;
+    used_blocks = retired_stats.used_blocks;
+    cached = retired_stats.cached;
+    for (ts = thread_stats_list; ts != NULL; ts = ts->next) {
+        in_use += __atomic_load_n(&ts->in_use, __ATOMIC_RELAXED);
+        used_blocks += __atomic_load_n(&ts->used_blocks, __ATOMIC_RELAXED);
+        cached += __atomic_load_n(&ts->cached, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    for (i = 0; i < count; i++) {
+        struct beavalloc_arena *arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+
+        if (arena == NULL) {
+            continue;
+        }
+        in_use += __atomic_load_n(&arena->stats.in_use, __ATOMIC_RELAXED);
+        used_blocks += __atomic_load_n(&arena->stats.used_blocks, __ATOMIC_RELAXED);
+        stats->free += __atomic_load_n(&arena->stats.free, __ATOMIC_RELAXED);
+        stats->free_blocks += __atomic_load_n(&arena->stats.free_blocks, __ATOMIC_RELAXED);
+        stats->splits += __atomic_load_n(&arena->stats.splits, __ATOMIC_RELAXED);
+        stats->coalesces += __atomic_load_n(&arena->stats.coalesces, __ATOMIC_RELAXED);
+    }
+
+    stats->in_use = MAX(in_use, 0);
+    stats->used_blocks = MAX(used_blocks, 0);
+    stats->cached = MAX(cached, 0);
+    stats->mapped = __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+    stats->peak_mapped = __atomic_load_n(&peak_mapped, __ATOMIC_RELAXED);
+    stats->sbrk_calls = __atomic_load_n(&sbrk_calls, __ATOMIC_RELAXED);
+    stats->mmap_calls = __atomic_load_n(&mmap_calls, __ATOMIC_RELAXED);
+}
+
+// The calling thread's counters, linked in the first time it counts
+//   anything. Not for a thread that has exited; see stats_count().
+static struct thread_stats *stats_get(void)
+{
+    if (!tstats.active) {
+        tstats.active = TRUE;
+        pthread_once(&stats_once, stats_init);
+        pthread_mutex_lock(&stats_lock);
+        tstats.prev = NULL;
+        tstats.next = thread_stats_list;
+        if (thread_stats_list != NULL) {
+            thread_stats_list->prev = &tstats;
+        }
+        thread_stats_list = &tstats;
+        pthread_mutex_unlock(&stats_lock);
+        pthread_setspecific(stats_key, &tstats);
     }
-    curr->capacity += curr->next->capacity + META_DATA;
-    curr->next = curr->next->next;
+    return &tstats;
 }
 
-static void coalesce_left(struct block *curr)
+static void stats_init(void)
 {
-    if (DEBUG) { diagnostic_message("coalesce left..."); }
-    if (curr->next == NULL) {
-        heap.tail = curr->prev;
+    pthread_key_create(&stats_key, stats_destroy);
+}
+
+// Runs as a thread exits, keeping its counts after its memory is gone.
+static void stats_destroy(void *arg)
+{
+    struct thread_stats *ts = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    retired_stats.in_use += ts->in_use;
+    retired_stats.used_blocks += ts->used_blocks;
+    retired_stats.cached += ts->cached;
+    if (ts->prev != NULL) {
+        ts->prev->next = ts->next;
     }
     else {
-        curr->next->prev = curr->prev;
+        thread_stats_list = ts->next;
     }
-    curr->prev->capacity += curr->capacity + META_DATA;
-    curr->prev->next = curr->next;
+    if (ts->next != NULL) {
+        ts->next->prev = ts->prev;
+    }
+    memset(ts, 0, sizeof(*ts));
+    pthread_mutex_unlock(&stats_lock);
+    tstats_exited = TRUE;
 }
 
-void beavalloc_reset(void)
+// Count blocks handed out or taken back. A user arena keeps the count
+//   itself; everything else counts against the calling thread.
+static void stats_used(struct beavalloc_arena *arena, int64_t bytes, int64_t blocks)
 {
-    brk(lower_mem_bound);
-    lower_mem_bound = NULL;
-    upper_mem_bound = NULL;
-    heap.head = NULL;
-    heap.tail = NULL;
+    if (arena != NULL && (arena->flags & ARENA_USER)) {
+        __atomic_add_fetch(&arena->stats.in_use, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&arena->stats.used_blocks, blocks, __ATOMIC_RELAXED);
+        return;
+    }
+    stats_count(bytes, blocks, 0);
+}
 
-    if (DEBUG) { diagnostic_message("heap reset!"); }
+// Count bytes going into or out of a thread or CPU cache.
+static void stats_cached(int64_t bytes)
+{
+    stats_count(0, 0, bytes);
 }
 
-void beavalloc_set_verbose(uint8_t v)
+// Count against the calling thread, or once it has exited against
+//   retired_stats, so it is never linked in again with its memory going.
+static void stats_count(int64_t bytes, int64_t blocks, int64_t cached)
 {
-    DEBUG = v;
+    struct thread_stats *ts = NULL;
+
+    if (tstats_exited) {
+        pthread_mutex_lock(&stats_lock);
+        retired_stats.in_use += bytes;
+        retired_stats.used_blocks += blocks;
+        retired_stats.cached += cached;
+        pthread_mutex_unlock(&stats_lock);
+        return;
+    }
+    ts = stats_get();
+    ts->in_use += bytes;
+    ts->used_blocks += blocks;
+    ts->cached += cached;
 }
 
-void *beavcalloc(size_t nmemb, size_t size)
+// Count core taken from or given back to the kernel, by the arena if
+//   there is one, whose lock the caller then holds.
+static void stats_mapped(struct beavalloc_arena *arena, int64_t bytes)
 {
-    void *data = NULL;
-    if (nmemb == 0 || size == 0)
-        return NULL;
+    size_t mapped = __atomic_add_fetch(&mapped_bytes, bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peak_mapped, __ATOMIC_RELAXED);
 
-    data = beavalloc(nmemb * size);
-    memset(data, 0, nmemb * size);
-    return data;
+    if (arena != NULL) {
+        arena->stats.mapped += bytes;
+    }
+    while (mapped > peak
+           && !__atomic_compare_exchange_n(&peak_mapped, &peak, mapped, TRUE
+                                           , __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
 }
 
-void *beavrealloc(void *ptr, size_t size)
+// After a reset only the user arenas have anything left.
+static void stats_reset(void)
 {
-    void *new_data = NULL;
-    struct block *ptr_block = NULL;
-    struct block *curr = NULL;
+    uint count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    struct thread_stats *ts = NULL;
+    size_t mapped = 0;
+    uint i = 0;
 
-    if (size == (size_t)NULL)
-        return NULL;
+    for (i = 0; i < count; i++) {
+        struct beavalloc_arena *arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
 
-    if (ptr == NULL) {
-        new_data = beavalloc(size * 2);
+        if (arena != NULL && (arena->flags & ARENA_USER)) {
+            mapped += arena->stats.mapped;
+        }
     }
-    else {
-        for (curr = heap.head; curr != NULL; curr = curr->next) {   // Find block that owns this data.
-            if (curr->data == ptr) {
-                ptr_block = curr;
-            }
+
+    pthread_mutex_lock(&stats_lock);
+    retired_stats.in_use = retired_stats.used_blocks = retired_stats.cached = 0;
+    for (ts = thread_stats_list; ts != NULL; ts = ts->next) {
+        ts->in_use = ts->used_blocks = ts->cached = 0;
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    __atomic_store_n(&mapped_bytes, mapped, __ATOMIC_RELAXED);
+    __atomic_store_n(&peak_mapped, mapped, __ATOMIC_RELAXED);
+    __atomic_store_n(&sbrk_calls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&mmap_calls, 0, __ATOMIC_RELAXED);
+}
+
+void beavalloc_dump(uint leaks_only)
+{
+    uint count = __atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE);
+    uint i = 0;
+
+    dump_arena(&main_arena, leaks_only);
+    for (i = 1; i < count; i++) {
+        struct beavalloc_arena *arena = __atomic_load_n(&arenas[i], __ATOMIC_ACQUIRE);
+
+        if (arena != NULL && arena->heap.head != NULL) {
+            fprintf(stderr, "arena %u ", i);
+            dump_arena(arena, leaks_only);
         }
+    }
+    dump_mapped(leaks_only);
+    dump_slabs(leaks_only);
+}
 
-        if (ptr_block == NULL) {
-            if (DEBUG) { diagnostic_message("beavrealloc: invalid address given"); }
-            return NULL;
+// Slabs are summed up per size class rather than listed one by one.
+static void dump_slabs(uint leaks_only)
+{
+    uint slabs[SLAB_CLASSES] = {0};
+    uint used[SLAB_CLASSES] = {0};
+    uint total[SLAB_CLASSES] = {0};
+    char *top = NULL;
+    char *p = NULL;
+    size_t i = 0;
+    size_t word = 0;
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        pthread_mutex_lock(&slab_classes[i].lock);
+        if (slab_classes[i].remote != NULL) {
+            slab_drain(&slab_classes[i]);
         }
+        pthread_mutex_unlock(&slab_classes[i].lock);
+    }
+    pthread_mutex_lock(&slab_lock);
+    top = slab_top;
+    for (p = slab_base; p != NULL && p < top; p += SLAB_SIZE) {
+        struct slab *slab = (struct slab *)p;
 
-        if (ptr_block->capacity >= size) {  // Can just decrease used space.
-            if (DEBUG) { diagnostic_message("beavrealloc: decreasing used space of block..."); }
-            ptr_block->size = size;
-            new_data = ptr_block->data;
+        if (slab->magic == SLAB_TAG(slab)) {
+            i = slab->size / ALIGNMENT - 1;
+            slabs[i]++;
+            used[i] += slab->count - slab->free;
+            for (word = 0; word < SLAB_MAP_WORDS; word++) {
+                used[i] -= __builtin_popcountl(slab->cached_map[word]);
+            }
+            total[i] += slab->count;
         }
-        else {                              // Allocate new block.
-            if (DEBUG) { diagnostic_message("beavrealloc: allocating new block..."); }
-            new_data = beavalloc(size);
-            memcpy(new_data, ptr, ptr_block->size);
-            beavfree(ptr);
+    }
+    pthread_mutex_unlock(&slab_lock);
+
+    for (i = 0; i < SLAB_CLASSES; i++) {
+        if (slabs[i] == 0 || (leaks_only && used[i] == 0)) {
+            continue;
         }
-        
+        fprintf(stderr, "  slab size %3zu: %u slabs  %u of %u objects %s\n"
+                , (i + 1) * ALIGNMENT, slabs[i], used[i], total[i]
+                , leaks_only ? "lost" : "in use");
     }
-    
-    return new_data;
 }
 
-void beavalloc_dump(uint leaks_only)
+static void dump_mapped(uint leaks_only)
+{
+    struct mmap_block *m = NULL;
+    uint i = 0;
+    size_t capacity_bytes = 0;
+
+    pthread_mutex_lock(&mmap_lock);
+    if (mmap_blocks != NULL) {
+        fprintf(stderr, leaks_only ? "mapped lost blocks\n" : "mapped blocks\n");
+        fprintf(stderr, "  %s\t%s\t%s\t%s\n", "blk no  ", "block add ", "data add  ", "capacity ");
+    }
+    for (m = mmap_blocks; m != NULL; m = m->next, i++) {
+        fprintf(stderr, "  %u\t\t%9p\t%9p\t%zu\n"
+                , i, &m->block, BLOCK_DATA(&m->block), m->block.capacity);
+        capacity_bytes += m->block.capacity;
+    }
+    if (mmap_blocks != NULL) {
+        fprintf(stderr, "  %s\t\t\t\t%zu\n"
+                , leaks_only ? "Total bytes lost" : "Total bytes mapped", capacity_bytes);
+    }
+    pthread_mutex_unlock(&mmap_lock);
+}
+
+static void dump_arena(struct beavalloc_arena *arena, uint leaks_only)
 {
     struct block *curr = NULL;
+    struct block *prev = NULL;
     uint i = 0;
     uint leak_count = 0;
-    uint user_bytes = 0;
-    uint capacity_bytes = 0;
-    uint block_bytes = 0;
-    uint used_blocks = 0;
-    uint free_blocks = 0;
+    size_t user_bytes = 0;
+    size_t capacity_bytes = 0;
+    size_t block_bytes = 0;
+    size_t used_blocks = 0;
+    size_t free_blocks = 0;
 
     if (leaks_only) {
         fprintf(stderr, "heap lost blocks\n");
@@ -311,7 +4340,7 @@ void beavalloc_dump(uint leaks_only)
         fprintf(stderr, "heap map\n");
     }
     fprintf(stderr
-            , "  %s\t%s\t%s\t%s\t%s" 
+            , "  %s\t%s\t%s\t%s\t%s"
             "\t%s\t%s\t%s\t%s\t%s\t%s"
             "\n"
             , "blk no  "
@@ -319,7 +4348,7 @@ void beavalloc_dump(uint leaks_only)
             , "next add  "
             , "prev add  "
             , "data add  "
-            
+
             , "blk off  "
             , "dat off  "
             , "capacity "
@@ -327,31 +4356,42 @@ void beavalloc_dump(uint leaks_only)
             , "blk size "
             , "status   "
         );
-    for (curr = heap.head, i = 0; curr != NULL; curr = curr->next, i++) {
-        if (leaks_only == FALSE || (leaks_only == TRUE && curr->free == FALSE)) {
+    pthread_mutex_lock(&arena->lock);
+    if (arena->remote_free != NULL) {
+        remote_drain(arena);
+    }
+    for (curr = arena->heap.head, i = 0; curr != arena->heap.tail; prev = curr, curr = BLOCK_NEXT(curr), i++) {
+        uint used = (curr->flags & BLOCK_USED) != 0;
+        uint fence = (curr->flags & BLOCK_FENCE) != 0;
+        uint cached = curr->magic == CACHED_TAG(curr);
+
+        if (leaks_only == FALSE || (leaks_only == TRUE && used && !fence && !cached)) {
             fprintf(stderr
-                    , "  %u\t\t%9p\t%9p\t%9p\t%9p\t%u\t\t%u\t\t"
-                      "%u\t\t%u\t\t%u\t\t%s\t%c\n"
+                    , "  %u\t\t%9p\t%9p\t%9p\t%9p\t%zu\t\t%zu\t\t"
+                      "%zu\t\t%zu\t\t%zu\t\t%s\t%c\n"
                     , i
                     , curr
-                    , curr->next
-                    , curr->prev
-                    , curr->data
-                    , (unsigned) ((void *) curr - lower_mem_bound)
-                    , (unsigned) ((void *) curr->data - lower_mem_bound)
-                    , (unsigned) curr->capacity
-                    , (unsigned) curr->size
-                    , (unsigned) (curr->capacity + META_DATA)
-                    , curr->free ? "free  " : "in use"
-                    , curr->free ? '*' : ' '
+                    , BLOCK_NEXT(curr)
+                    , prev
+                    , BLOCK_DATA(curr)
+                    , (size_t) ((void *) curr - arena->lower_mem_bound)
+                    , (size_t) (BLOCK_DATA(curr) - arena->lower_mem_bound)
+                    , curr->capacity
+                    , used ? curr->capacity : 0
+                    , curr->capacity + META_DATA
+                    , fence ? "fence " : cached ? "cached" : used ? "in use" : "free  "
+                    , used ? ' ' : '*'
                 );
-            user_bytes += curr->size;
+            if (fence) {
+                continue;
+            }
+            user_bytes += used ? curr->capacity : 0;
             capacity_bytes += curr->capacity;
-            block_bytes += curr->capacity + sizeof(struct block);
-            if (curr->free == FALSE && leaks_only == TRUE) {
+            block_bytes += curr->capacity + META_DATA;
+            if (used && leaks_only == TRUE) {
                 leak_count++;
             }
-            if (curr->free == TRUE) {
+            if (!used) {
                 free_blocks++;
             }
             else {
@@ -359,6 +4399,7 @@ void beavalloc_dump(uint leaks_only)
             }
         }
     }
+    pthread_mutex_unlock(&arena->lock);
     if (leaks_only) {
         if (leak_count == 0) {
             fprintf(stderr, "  *** No leaks found!!! That does NOT mean no leaks are possible. ***\n");
@@ -366,7 +4407,7 @@ void beavalloc_dump(uint leaks_only)
         else {
             fprintf(stderr
                     , "  %s\t\t\t\t\t\t\t\t\t\t\t\t"
-                      "%u\t\t%u\t\t%u\n"
+                      "%zu\t\t%zu\t\t%zu\n"
                     , "Total bytes lost"
                     , capacity_bytes
                     , user_bytes
@@ -377,16 +4418,16 @@ void beavalloc_dump(uint leaks_only)
     else {
         fprintf(stderr
                 , "  %s\t\t\t\t\t\t\t\t\t\t\t\t"
-                "%u\t\t%u\t\t%u\n"
+                "%zu\t\t%zu\t\t%zu\n"
                 , "Total bytes used"
                 , capacity_bytes
                 , user_bytes
                 , block_bytes
             );
-        fprintf(stderr, "  Used blocks: %u  Free blocks: %u  "
+        fprintf(stderr, "  Used blocks: %zu  Free blocks: %zu  "
              "Min heap: %p    Max heap: %p\n"
                , used_blocks, free_blocks
-               , lower_mem_bound, upper_mem_bound
+               , arena->lower_mem_bound, arena->upper_mem_bound
             );
     }
 }
@@ -395,4 +4436,4 @@ static void diagnostic_message(const char *message)
 {
     fprintf(stderr, message);
     fprintf(stderr, "\n");
-}
\ No newline at end of file
+}
@@ -1,11 +1,30 @@
 // R. Jesse Chaney
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+
+// Per-CPU caches need restartable sequences, registered by glibc 2.35 and
+//   later, and are only written for x86_64.
+#if defined(__x86_64__) && defined(__has_include)
+# if __has_include(<sys/rseq.h>)
+#  include <sys/rseq.h>
+#  define HAVE_RSEQ 1
+# endif
+#endif
 
 #ifndef __BEAVALLOC_H
 # define __BEAVALLOC_H
@@ -27,24 +46,437 @@
 
 #define MIN_MEM     1024
 #define META_DATA   sizeof(struct block)
+#define FOOTER      sizeof(size_t)
+#define BLOCK_MAGIC 0xbea7a110
+#define FREE_KEY    0x0f4e0000  // magic ^ FREE_KEY marks a free block
+#define CACHED_KEY  0x0000cace  // magic ^ CACHED_KEY marks a thread cached block
+#define ALIGNMENT   16
+#define ALIGN_SIZE(_s) (((_s) + (ALIGNMENT - 1)) & ~((size_t)ALIGNMENT - 1))
+
+// Smallest capacity that still has room for the free list links and
+//   the footer once the block is freed.
+#define MIN_CAPACITY ALIGN_SIZE(sizeof(struct free_links) + FOOTER)
+
+// Where a request is placed among the free blocks is picked at build
+//   time, with make POLICY=bins, firstfit, nextfit or bestfit.
+#define POLICY_BINS         0   // first block of the smallest bin that fits
+#define POLICY_FIRST_FIT    1   // lowest addressed block that fits
+#define POLICY_NEXT_FIT     2   // first that fits past the last one taken
+#define POLICY_BEST_FIT     3   // bins, with best fit from TREE_MIN up
+#ifndef POLICY
+# define POLICY POLICY_BEST_FIT
+#endif // POLICY
+
+#if POLICY == POLICY_BINS
+# define POLICY_NAME "bins"
+#elif POLICY == POLICY_FIRST_FIT
+# define POLICY_NAME "firstfit"
+#elif POLICY == POLICY_NEXT_FIT
+# define POLICY_NAME "nextfit"
+#elif POLICY == POLICY_BEST_FIT
+# define POLICY_NAME "bestfit"
+#else
+# error "unknown POLICY"
+#endif // POLICY
+
+// The bins and best fit keep free blocks in segregated bins. Below
+//   BIN_LINEAR_MAX there is one bin per ALIGNMENT bytes, above it every
+//   power of two is split into BIN_SUBCLASSES intermediate classes.
+#define BIN_LINEAR_MAX  64
+#define BIN_SUBCLASSES  4
+#define NUM_BINS        256
+#define BIN_WORDS       (NUM_BINS / 64)
+
+// With best fit, from TREE_MIN bytes up each bin is a treap ordered by
+//   capacity and then address instead of a list, so the best fit within
+//   a size class is found in O(log n) and the bitmap still skips to the
+//   class.
+#define BEST_FIT        (POLICY == POLICY_BEST_FIT)
+#define TREE_MIN        1024
+
+// First and next fit keep every free block on one list in address order.
+#define ADDRESS_ORDER   (POLICY == POLICY_FIRST_FIT || POLICY == POLICY_NEXT_FIT)
 
+// Bits in struct block flags.
+#define BLOCK_USED      0x1     // handed out to the user
+#define BLOCK_PREV_FREE 0x2     // left neighbour is free, its footer is valid
+#define BLOCK_FENCE     0x4     // covers memory someone else took with sbrk()
+#define BLOCK_MMAPPED   0x8     // has a mapping of its own, see struct mmap_block
+#define BLOCK_SAMPLED   0x10    // recorded by the heap profiler
+#define BLOCK_ZEROED    0x20    // free, and the pages purge_block() drops are zero
 
+
+// Boundary tag header placed immediately before every block's data.
+//   A free block also stores its capacity in its last word (the footer),
+//   and its free list links at the start of its data, so both physical
+//   neighbours can be found by address arithmetic.
 struct block
 {
-    size_t size;
+    uint32_t magic;
+    uint32_t flags;
     size_t capacity;
-    int free;
+};
+
+struct free_links
+{
     struct block *prev;
     struct block *next;
-    void *data;
 };
 
-struct linked_list
+// Where a free block in the tree keeps its links, in place of its free
+//   list links. A node's priority is a hash of its address.
+struct free_tree
+{
+    struct block *left;
+    struct block *right;
+    struct block *parent;
+};
+
+// Each thread keeps recently freed small blocks in a cache of its own,
+//   one LIFO list per capacity class, so most frees and allocations never
+//   touch the heap lock. Cached blocks still look in use to the heap.
+//   Blocks move between a cache and the heap several at a time.
+#define TCACHE_MAX      1024    // largest capacity a thread will cache
+#define TCACHE_CLASSES  (TCACHE_MAX / ALIGNMENT + 1)
+#define TCACHE_COUNT    32      // blocks per class before half are flushed
+#define TCACHE_BATCH    8       // most blocks taken per refill
+
+struct thread_cache
+{
+    uint64_t generation;        // heap generation the blocks belong to
+    uint8_t active;
+    void *head[TCACHE_CLASSES];
+    uint16_t count[TCACHE_CLASSES];
+    uint16_t batch[TCACHE_CLASSES];
+};
+
+// With the per-CPU caches on, small heap blocks and slab objects are
+//   freed into an array belonging to the CPU the thread is running on,
+//   one per capacity class, and handed out to whichever thread runs there
+//   next. The arrays are pushed and popped inside restartable sequences:
+//   a thread that is moved or interrupted partway through starts over, so
+//   neither a lock nor an atomic instruction is needed. What sits cached
+//   is bounded by the number of CPUs rather than of threads. A thread
+//   without rseq falls back to its own cache.
+#define CPU_CACHE_COUNT 32      // objects per class per CPU
+
+struct cpu_class
+{
+    uint64_t count;             // must stay first, the push and pop code
+    void *slots[CPU_CACHE_COUNT];       //   assumes the slots follow it
+};
+
+struct cpu_cache
+{
+    struct cpu_class classes[TCACHE_CLASSES];
+} __attribute__((aligned(64)));
+
+// Small requests are served from slabs: SLAB_SIZE aligned pages that each
+//   hold objects of one size class with no header of their own. The
+//   slab's header sits at the start of its page, found by masking an
+//   object's address, with a bitmap of the free objects. All slabs come
+//   out of one SLAB_RESERVE range, so an address check tells a slab
+//   object from a heap block.
+#define SLAB_SIZE       4096UL
+#define SLAB_MAX        256     // largest object served from a slab
+#define SLAB_CLASSES    (SLAB_MAX / ALIGNMENT)
+#define SLAB_RESERVE    (1UL << 30)
+#define SLAB_CHUNK      (64UL * 1024)   // slab space committed at a time
+#define SLAB_COUNT      (SLAB_RESERVE / SLAB_SIZE)
+#define SLAB_MAGIC      0x51ab0000
+#define SLAB_MAP_WORDS  (SLAB_SIZE / ALIGNMENT / 64)
+
+struct slab
+{
+    uint32_t magic;
+    uint16_t size;              // object size
+    uint16_t count;             // objects in the slab
+    uint16_t free;              // objects not handed out
+    uint16_t first;             // offset of the first object
+    uint32_t remote_pending;    // objects set in remote_map since the last drain
+    struct slab *prev;          // other slabs of the class with free objects
+    struct slab *next;
+    struct slab *remote_next;   // next slab on the class's remote list
+    uint64_t free_map[SLAB_MAP_WORDS];  // set bits are free objects
+    uint64_t remote_map[SLAB_MAP_WORDS];        // freed, not yet in free_map
+    uint64_t cached_map[SLAB_MAP_WORDS];        // held in a per-CPU cache
+};
+
+struct slab_class
+{
+    pthread_mutex_t lock;
+    struct slab *partial;       // slabs with free objects
+    struct slab *remote;        // slabs with objects in their remote_map
+};
+
+// A thread that frees a heap block of another thread's arena, or a slab
+//   object while its class is locked, does not wait for the lock. The
+//   block is pushed with one compare and swap onto a list of the arena's
+//   (the object's bit set in its slab's remote map), and whoever next
+//   takes the lock to allocate drains the lot. Once REMOTE_BATCH blocks
+//   are waiting on an arena the thread pushing them drains them itself
+//   if the lock is free, so an arena nobody allocates from any more does
+//   not hold on to them.
+#define REMOTE_BATCH    64
+
+// A block of at most FAST_MAX freed into its arena goes on the fast bin
+//   of its capacity, a LIFO list, and is not merged with its neighbours,
+//   so a size freed and asked for again costs a push and a pop rather
+//   than a merge and a split. Fast blocks are marked cached and still
+//   look in use to the heap around them. They are consolidated, freed
+//   for real, when a request larger than FAST_MAX finds no free block,
+//   once FAST_LIMIT bytes of them are waiting, and before a trim.
+#define FAST_MAX        512
+#define FAST_CLASSES    (FAST_MAX / ALIGNMENT + 1)
+#define FAST_LIMIT      (64UL * 1024)
+
+// The heap is one run of blocks walked by address, closed off by a
+//   zero capacity sentinel (the tail) that is always in use.
+struct heap_bounds
 {
     struct block *head;
     struct block *tail;
 };
 
+// Requests of at least the mmap threshold skip the heap and get a mapping
+//   of their own, which goes straight back to the kernel when freed. The
+//   header links to the other mapped blocks for dumps and resets, then
+//   holds the usual header. It opens the mapping, except in an aligned
+//   mapping, where it sits lead bytes in so the data lands on the
+//   alignment. A pointer is known to be a mapped block by finding its
+//   header in a table of the live ones, MMAP_TABLE_MIN slots to start,
+//   before anything is read through it. A threshold of 0 turns the mmap
+//   path off.
+#define MMAP_THRESHOLD  (128UL * 1024)
+#define MMAP_TABLE_MIN  256
+
+struct mmap_block
+{
+    uint64_t lead;              // bytes of the mapping before the header
+    uint64_t unused;            // keeps the data aligned
+    struct mmap_block *prev;
+    struct mmap_block *next;
+    struct block block;
+};
+
+// A free block of at least the trim threshold gives its memory back to
+//   the kernel as it is freed: from the top of the heap by lowering the
+//   break, from anywhere else by dropping its interior pages. A threshold
+//   of 0 leaves it all to beavalloc_trim().
+#define TRIM_THRESHOLD  (128UL * 1024)
+
+// beavrealloc() only cuts the tail off a shrinking heap block when the
+//   tail is at least a quarter of the block, or a page of a large one.
+//   Smaller steps down keep the block as it is, so a block shrunk a little
+//   at a time is not split into slivers, and can grow back in place.
+#define SHRINK_FRACTION 4
+#define SHRINK_PAGE     4096
+
+// With background purging on, beavfree() leaves that to a thread that
+//   wakes DECAY_STEPS times per decay time. Each arena remembers how much
+//   was freed in each of the last DECAY_STEPS ticks, and of what was
+//   freed k ticks ago a share of 1 - smoothstep(k / DECAY_STEPS) may stay
+//   dirty, so freed memory drifts back to the kernel over the decay time
+//   rather than all at once. Anything dirty past that is purged from the
+//   top of the heap down, then from the largest free blocks.
+#define DECAY_MS        10000   // decay time beavalloc_set_decay() is usually given
+#define DECAY_STEPS     20
+
+// A heap grows by at least the request, rounded up to MIN_MEM, and by at
+//   least a step that starts at GROW_MIN and doubles with each growth up
+//   to GROW_MAX, so a run of small requests costs few sbrk() calls. What
+//   the request does not need is left free at the top of the heap.
+//   GROW_MAX stays under the trim threshold so that leftover is not given
+//   straight back.
+#define GROW_MIN        (4UL * 1024)
+#define GROW_MAX        (64UL * 1024)
+
+// An arena is a heap of its own with its own lock. The default arena
+//   grows with sbrk(); every other arena reserves ARENA_RESERVE bytes of
+//   address space with mmap() and commits it ARENA_CHUNK bytes at a time.
+//   Threads are handed arenas round-robin the first time they allocate.
+#define ARENA_RESERVE   (1UL << 30)
+#define ARENA_CHUNK     (256UL * 1024)
+#define MAX_ARENAS      64
+#define MAX_AUTO_ARENAS 32      // arenas beavalloc() may hand out to threads
+
+#define ARENA_SBRK      0x1     // grows with sbrk(), only the default arena
+#define ARENA_USER      0x2     // made by beavalloc_arena_create()
+
+// Counters an arena keeps under its lock. Arenas from
+//   beavalloc_arena_create() also count their own blocks in use, so the
+//   counts go away with the arena.
+struct arena_stats
+{
+    size_t free;                // capacity of the blocks in the bins and fast bins
+    uint64_t free_blocks;
+    size_t mapped;              // core the heap has taken
+    int64_t in_use;
+    int64_t used_blocks;
+    uint64_t splits;
+    uint64_t coalesces;
+};
+
+struct beavalloc_arena
+{
+    pthread_mutex_t lock;
+    uint index;                 // slot in the arena table
+    uint flags;
+    void *lower_mem_bound;
+    void *upper_mem_bound;      // end of the heap's tail sentinel
+    void *commit_end;           // end of the memory made read/write
+    void *reserve_end;          // end of the reserved address space
+    struct heap_bounds heap;
+    struct block *bins[NUM_BINS];
+    uint64_t bin_map[BIN_WORDS];
+    struct block *free_list;    // every free block by address, ADDRESS_ORDER
+    struct block *rover;        // next fit searches on from the block after
+    size_t grow;                // the next growth step, 0 for grow_min
+    struct block *remote_free;  // blocks other threads freed, see REMOTE_BATCH
+    uint remote_count;
+    struct block *fast[FAST_CLASSES];   // see FAST_MAX
+    size_t fast_bytes;
+    size_t dirty;               // freed and not purged since, roughly
+    size_t decay_freed[DECAY_STEPS];    // freed in each of the last ticks
+    uint decay_epoch;           // decay_freed slot of the current tick
+    struct arena_stats stats;
+};
+
+// A region hands out memory by bumping a pointer through chunks it gets
+//   from beavalloc(), with no header on each object, and lets it all go
+//   at once. Each chunk starts with its link, and the first chunk also
+//   holds the region itself. Chunks double from REGION_CHUNK_MIN up to
+//   REGION_CHUNK_MAX as the region grows.
+#define REGION_CHUNK_MIN    (4UL * 1024)
+#define REGION_CHUNK_MAX    (1024UL * 1024)
+
+struct region_chunk
+{
+    struct region_chunk *next;
+    char *end;                  // one past the chunk's last byte
+};
+
+struct beavalloc_region
+{
+    struct region_chunk *first; // the chunk the region lives in
+    struct region_chunk *curr;  // the chunk being bumped through
+    char *top;                  // next free byte of curr
+    size_t next_size;           // size of the next chunk to be made
+};
+
+// Counters a thread keeps for itself, without a lock. A block freed by
+//   another thread than the one that allocated it leaves one thread's
+//   counts short and the other's over, which evens out in the sum.
+struct thread_stats
+{
+    int64_t in_use;
+    int64_t used_blocks;
+    int64_t cached;
+    uint8_t active;
+    struct thread_stats *prev;
+    struct thread_stats *next;
+};
+
+// What beavalloc_stats() reports. Bytes in use are counted by usable
+//   size, so a 10 byte request shows up as the 16 it was given.
+struct beavalloc_stats
+{
+    size_t in_use;              // handed out and not yet freed
+    size_t cached;              // held in thread and CPU caches
+    size_t free;                // in free heap blocks
+    size_t mapped;              // taken from the kernel and not given back
+    size_t peak_mapped;         // most ever mapped at once
+    uint64_t used_blocks;
+    uint64_t free_blocks;
+    uint64_t sbrk_calls;        // sbrk() and brk()
+    uint64_t mmap_calls;        // mmap(), mremap(), mprotect() and munmap()
+    uint64_t splits;
+    uint64_t coalesces;
+};
+
+// The heap profiler samples an allocation about once every PROF_RATE
+//   bytes, at random so that no allocation pattern can hide from it, and
+//   keeps the call stack of each. Sampled allocations skip the slabs so
+//   their header can carry BLOCK_SAMPLED, which beavfree() checks to take
+//   the sample back out. Stacks and live samples are kept in tables
+//   mapped straight from the kernel, so the profiler never allocates.
+#define PROF_RATE       (512UL * 1024)
+#define PROF_DEPTH      32      // deepest stack kept
+#define PROF_BUCKETS    4096    // distinct stacks
+#define PROF_SAMPLES    (1UL << 16)     // sampled blocks live at once
+
+#define PROF_PPROF      0       // legacy pprof heap profile
+#define PROF_FOLDED     1       // folded stacks, as flame graph tools take
+
+// Everything sampled from one call stack.
+struct prof_bucket
+{
+    uint64_t hash;
+    uint depth;
+    void *pcs[PROF_DEPTH];
+    uint64_t allocs;            // sampled allocations ever
+    uint64_t alloc_bytes;
+    uint64_t live;              // sampled allocations not yet freed
+    uint64_t live_bytes;
+    uint64_t live_estimate;     // live bytes the samples stand for
+};
+
+// A sampled block not yet freed, found by its address.
+struct prof_sample
+{
+    void *ptr;
+    size_t size;
+    uint64_t estimate;
+    struct prof_bucket *bucket;
+};
+
+// What each thread has left to allocate before its next sample.
+struct prof_thread
+{
+    int64_t left;
+    uint64_t seed;
+    uint8_t busy;               // in the profiler, nothing is sampled
+};
+
+// A trace is TRACE_MAGIC followed by one record per call, in the order the
+//   calls returned, except that a free, or a realloc that moves the block,
+//   is recorded before the block goes back, so a block is never seen
+//   handed out again before it is freed.
+//   A record is its op byte then unsigned LEB128 varints: the thread, the
+//   nanoseconds since the record before, and the op's fields. Pointers
+//   are stored as the zigzag difference from the pointer stored last,
+//   which keeps most of them to a byte or two.
+//     TRACE_ALLOC    size, result
+//     TRACE_FREE     ptr
+//     TRACE_CALLOC   nmemb, size, result
+//     TRACE_REALLOC  ptr, size, result
+//     TRACE_ALIGNED  alignment, size, result
+#define TRACE_MAGIC     "BEAVTRC1"
+#define TRACE_BUFFER    (64 * 1024)
+#define TRACE_RECORD    64      // longest a record can be
+
+#define TRACE_ALLOC     1
+#define TRACE_FREE      2
+#define TRACE_CALLOC    3
+#define TRACE_REALLOC   4
+#define TRACE_ALIGNED   5
+
+// One decoded record. time and last_ptr carry the decoder from one record
+//   to the next, so the same struct, zeroed to begin with, has to be
+//   passed for every record of a trace.
+struct beavalloc_trace_rec
+{
+    uint op;
+    uint thread;                // numbered from 1 in order of first call
+    uint64_t time;              // nanoseconds since the trace started
+    uint64_t ptr;
+    uint64_t arg;               // nmemb or alignment
+    uint64_t size;
+    uint64_t result;
+    uint64_t last_ptr;
+    uint64_t count;             // records read so far
+};
+
 
 // The basic memory allocator.
 // If you pass NULL or 0, then NULL is returned.
@@ -52,10 +484,34 @@ struct linked_list
 //   memory, set errno to ENOMEM and return NULL.
 // You must use sbrk() or brk() in requesting more memory for your
 //   beavalloc() routine to manage.
-// When calling sbrk() for more memory, always request 1024 bytes. It
-//   is best if you use a macro for this value, in case it needs to change.
+// sbrk() is asked for whole multiples of MIN_MEM, and for more than the
+//   request as the heap grows; see beavalloc_set_growth().
 void *beavalloc(size_t size);
 
+// Turn the per-thread caches on or off. Turning them off flushes the
+//   calling thread's cache back to the heap; other threads' caches are
+//   flushed as those threads exit.
+void beavalloc_set_thread_cache(uint8_t v);
+
+// Turn the per-CPU caches on or off. They are off unless asked for, and
+//   stay off where the kernel or C library has no restartable sequences.
+//   Returns TRUE if they are on. Objects left in them when they are
+//   turned off wait there until they are turned back on or the heap is
+//   reset.
+int beavalloc_set_cpu_cache(uint8_t v);
+
+// Turn the slabs for small requests on or off. Objects already handed
+//   out from slabs can still be freed with them off.
+void beavalloc_set_slabs(uint8_t v);
+
+// Turn the fast bins on or off. Turning them off consolidates what every
+//   arena has in them.
+void beavalloc_set_fast_bins(uint8_t v);
+
+// Turn remote frees on or off. Off, a free of another thread's block
+//   waits for the lock of the arena or slab class it came from.
+void beavalloc_set_remote_free(uint8_t v);
+
 // A pointer returned from a previous call to beavalloc() must
 //   be passed.
 // If a pointer is passed to a block than is already free, 
@@ -79,9 +535,119 @@ void beavalloc_reset(void);
 // This should modify a variable that is static to your C module.
 void beavalloc_set_verbose(uint8_t v);
 
+// Give free memory back to the kernel, keeping pad bytes free at the top
+//   of each heap. Returns 1 if any memory was released, 0 otherwise.
+int beavalloc_trim(size_t pad);
+
+// Set the free block size from which beavfree() trims on its own. 0
+//   turns automatic trimming off.
+void beavalloc_set_trim_threshold(size_t threshold);
+
+// Purge free memory from a background thread over a decay time of ms
+//   milliseconds instead of trimming as blocks are freed; see DECAY_MS.
+//   0 stops the thread and goes back to the trim threshold. Returns 0, or
+//   -1 if the thread could not be started. A forked child starts with it
+//   off.
+int beavalloc_set_decay(size_t ms);
+
+// Set the size from which beavalloc() maps blocks directly. 0 turns
+//   direct mapping off.
+void beavalloc_set_mmap_threshold(size_t threshold);
+
+// Set the smallest and largest step a heap grows by, rounded up to
+//   MIN_MEM. Each growth doubles the step from min up to max, and
+//   beavalloc_reset() starts it at min again. Setting both to MIN_MEM
+//   grows the heap by just what each request needs.
+void beavalloc_set_growth(size_t min, size_t max);
+
+// Returns NULL with errno set to ENOMEM if nmemb * size overflows.
+//   Memory known to be zero is not cleared again: a mapped block, and
+//   the whole pages of a heap block fresh from the kernel or purged
+//   while it was free.
 void *beavcalloc(size_t nmemb, size_t size);
 void *beavrealloc(void *ptr, size_t size);
 
+// Allocate size bytes at a multiple of alignment, which has to be a power
+//   of two. Otherwise errno is set to EINVAL and NULL returned. The memory
+//   is freed with beavfree() like any other.
+void *beavalloc_aligned(size_t alignment, size_t size);
+
+// The same with the interfaces of memalign(), aligned_alloc() and
+//   posix_memalign(). beavposix_memalign() returns the error rather than
+//   setting errno, and also wants alignment to be a multiple of
+//   sizeof(void *).
+void *beavmemalign(size_t alignment, size_t size);
+void *beavaligned_alloc(size_t alignment, size_t size);
+int beavposix_memalign(void **memptr, size_t alignment, size_t size);
+
 void beavalloc_dump(uint leaks_only);
 
+// Fill in stats from counters kept as the allocator runs. Nothing is
+//   walked, only the arenas and threads summed, so it is cheap enough to
+//   call at any rate. The counts are each current but not taken together
+//   at one instant while other threads are allocating.
+void beavalloc_stats(struct beavalloc_stats *stats);
+
+// How many bytes the block at ptr can hold, 0 if it is not one of ours.
+size_t beavalloc_usable_size(void *ptr);
+
+// Handlers for pthread_atfork(). Every lock in the allocator is taken
+//   before fork() and released again on both sides afterwards, so the
+//   child never starts with a lock some other thread was holding.
+void beavalloc_atfork_prepare(void);
+void beavalloc_atfork_parent(void);
+void beavalloc_atfork_child(void);
+
+// Arenas are independent heaps. Memory from one is given back to the
+//   same arena, or with beavfree(); destroying an arena releases all of
+//   its memory at once. beavalloc() itself works from arenas picked per
+//   thread, starting with the default arena. An arena must be idle when
+//   it is destroyed, with no other thread allocating from it or freeing
+//   into it; one found in the middle of a call is not destroyed.
+struct beavalloc_arena *beavalloc_arena_create(void);
+void beavalloc_arena_destroy(struct beavalloc_arena *arena);
+void *beavalloc_arena_alloc(struct beavalloc_arena *arena, size_t size);
+void beavalloc_arena_free(struct beavalloc_arena *arena, void *ptr);
+
+// Regions are for memory that all dies together, such as everything one
+//   request allocates. Objects from a region are never freed on their
+//   own: beavalloc_region_reset() takes them all back and keeps the
+//   chunks for reuse, and beavalloc_region_destroy() gives the chunks
+//   back to the heap. A region has no lock, so it belongs to one thread
+//   at a time, and like any other memory from beavalloc() its chunks are
+//   gone after beavalloc_reset().
+struct beavalloc_region *beavalloc_region_create(void);
+void beavalloc_region_destroy(struct beavalloc_region *region);
+void *beavalloc_region_alloc(struct beavalloc_region *region, size_t size);
+void beavalloc_region_reset(struct beavalloc_region *region);
+
+// Record every beavalloc(), beavfree(), beavcalloc(), beavrealloc() and
+//   aligned allocation to the trace file at path until
+//   beavalloc_trace_stop(). Returns 0, or -1 with errno set. A child made
+//   by fork() does not go on writing its parent's trace.
+int beavalloc_trace_start(const char *path);
+void beavalloc_trace_stop(void);
+
+// Sample about one allocation in every rate bytes, 0 meaning PROF_RATE,
+//   until beavalloc_prof_stop(). Returns 0, or -1 with errno set if the
+//   tables cannot be mapped. Samples already taken stay until freed or
+//   the heap is reset.
+int beavalloc_prof_start(size_t rate);
+void beavalloc_prof_stop(void);
+
+// Write the stacks that hold sampled memory to path as format,
+//   PROF_PPROF or PROF_FOLDED. The pprof profile has the raw samples and
+//   the rate, which pprof scales up itself; folded stacks carry the
+//   estimated live bytes. Returns 0, or -1 with errno set.
+int beavalloc_prof_dump(const char *path, int format);
+
+// Dump to path as format whenever signal signo arrives. The dump is
+//   written by the next allocation that is sampled, not by the signal
+//   handler, which could have interrupted the profiler itself.
+int beavalloc_prof_signal(int signo, const char *path, int format);
+
+// Read the next record of a trace. Returns 1 for a record, 0 at the end
+//   of the trace and -1 if in is not a trace or ends part way through.
+int beavalloc_trace_read(FILE *in, struct beavalloc_trace_rec *rec);
+
 #endif // __BEAVALLOC_H
@@ -0,0 +1,978 @@
+/*
+ * @brief Benchmarks for the beavalloc allocator.
+ */
+
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "beavalloc.h"
+
+#define OPTIONS "hk:T:sfP"
+
+// Latencies are counted in buckets, 16 to each power of two, so the
+//   percentiles come out within about 6% without keeping every sample.
+#define LAT_SUBBUCKETS  16
+#define LAT_BUCKETS     (64 * LAT_SUBBUCKETS)
+#define RING_SIZE       1024
+#define MAX_PIPELINES   64
+
+struct latency
+{
+    uint64_t count[LAT_BUCKETS];
+    uint64_t ops;
+};
+
+// The allocator a scenario runs against.
+struct allocator
+{
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+};
+
+struct scenario
+{
+    const char *name;
+    size_t (*run)(const struct allocator *a, struct latency *lat);
+};
+
+#ifndef MAX_LIVE
+# define MAX_LIVE 65536
+#endif // MAX_LIVE
+
+static void *live[MAX_LIVE];
+static char out_buf[BUFSIZ];
+static uint num_ops = 2000;
+static uint max_threads = 32;
+static pthread_barrier_t start_barrier;
+static uint64_t thread_start[1024];
+static uint64_t thread_end[1024];
+static uint8_t scenarios_only = FALSE;
+static uint8_t fragmentation_only = FALSE;
+static uint8_t policy_rows = FALSE;
+static struct beavalloc_stats frag_stats;
+
+// Producer/consumer hand off through a single producer, single consumer
+//   ring.
+static void *ring[RING_SIZE];
+static size_t ring_size[RING_SIZE];
+static uint64_t ring_head = 0;
+static uint64_t ring_tail = 0;
+static uint64_t live_bytes = 0;
+static uint64_t peak_bytes = 0;
+
+// Each producer/consumer pair of bench_pipelines() has a ring of its own.
+struct pipeline
+{
+    void *ring[RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+};
+
+static struct pipeline pipelines[MAX_PIPELINES];
+
+static uint64_t now_ns(void);
+static void bench_live_blocks(void);
+static void bench_ping_pong(void);
+static void bench_threads(void);
+static void bench_realloc_growth(void);
+static void bench_small_objects(void);
+static void bench_fragmentation(void);
+static size_t scenario_frag(const struct allocator *a, struct latency *lat);
+static size_t frag_size(uint *seed, uint phase);
+static size_t rss_bytes(void);
+static void *thread_pairs(void *arg);
+static void bench_pipelines(void);
+static void *pipeline_produce(void *arg);
+static void *pipeline_consume(void *arg);
+static void bench_scenarios(void);
+static void run_scenario(const struct scenario *sc, const struct allocator *a);
+static void lat_record(struct latency *lat, uint64_t ns);
+static uint64_t lat_percentile(const struct latency *lat, double p);
+static void live_add(size_t size);
+static void live_sub(size_t size);
+static size_t scenario_pairs(const struct allocator *a, struct latency *lat);
+static size_t scenario_churn(const struct allocator *a, struct latency *lat);
+static size_t scenario_prodcons(const struct allocator *a, struct latency *lat);
+static void *thread_consumer(void *arg);
+static size_t scenario_realloc(const struct allocator *a, struct latency *lat);
+static size_t scenario_calloc(const struct allocator *a, struct latency *lat);
+
+int
+main(int argc, char **argv)
+{
+    int opt = -1;
+
+    // stdout must not allocate through malloc(), it would share the break.
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'h':
+            fprintf(stderr, "%s %s\n", argv[0], OPTIONS);
+            exit(0);
+            break;
+        case 'k':
+            num_ops = atoi(optarg);
+            break;
+        case 'T':
+            max_threads = MIN(atoi(optarg), 1024);
+            break;
+        case 's':
+            scenarios_only = TRUE;
+            break;
+        case 'f':
+            fragmentation_only = TRUE;
+            break;
+        case 'P':
+            policy_rows = TRUE;
+            scenarios_only = TRUE;
+            break;
+        default: /* '?' */
+            fprintf(stderr, "%s\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (fragmentation_only) {
+        bench_fragmentation();
+        return 0;
+    }
+    bench_scenarios();
+    if (scenarios_only) {
+        return 0;
+    }
+    bench_live_blocks();
+    bench_ping_pong();
+    bench_threads();
+    bench_pipelines();
+    bench_realloc_growth();
+    bench_small_objects();
+    bench_fragmentation();
+
+    return 0;
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// Resident set size from /proc, read without going through malloc().
+static size_t
+rss_bytes(void)
+{
+    char buf[64] = {0};
+    size_t pages = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+
+    if (file == NULL) {
+        return 0;
+    }
+    setvbuf(file, buf, _IOFBF, sizeof(buf));
+    if (fscanf(file, "%*u %zu", &pages) != 1) {
+        pages = 0;
+    }
+    fclose(file);
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+// Allocation latency as the number of live blocks in the heap grows.
+//   Each round pins down `n` blocks and then times `num_ops` alloc/free
+//   pairs on top of them.
+static void
+bench_live_blocks(void)
+{
+    uint n = 0;
+    uint i = 0;
+
+    printf("live blocks\n");
+    printf("  %10s %14s %14s\n", "live", "alloc ns/op", "free ns/op");
+    for (n = 1024; n <= MAX_LIVE; n *= 4) {
+        uint64_t alloc_ns = 0;
+        uint64_t free_ns = 0;
+
+        for (i = 0; i < n; i++) {
+            live[i] = beavalloc(64 + (i % 8) * 16);
+        }
+        for (i = 0; i < num_ops; i++) {
+            uint64_t t0 = now_ns();
+            void *ptr = beavalloc(64);
+            uint64_t t1 = now_ns();
+
+            beavfree(ptr);
+            alloc_ns += t1 - t0;
+            free_ns += now_ns() - t1;
+        }
+        printf("  %10u %14.1f %14.1f\n", n
+               , (double) alloc_ns / num_ops
+               , (double) free_ns / num_ops);
+        fflush(stdout);
+
+        for (i = 0; i < n; i++) {
+            beavfree(live[i]);
+        }
+        beavalloc_reset();
+    }
+}
+
+// One block freed and asked for again over and over, just below the free
+//   top of the heap, with and without the fast bins. The thread caches
+//   and slabs are turned off so every call reaches the arena. Without the
+//   fast bins each free merges the block into the top and the next alloc
+//   splits it off again.
+static void
+bench_ping_pong(void)
+{
+    static const size_t sizes[] = {32, 128, 512};
+    uint8_t fast = 0;
+    size_t i = 0;
+
+    printf("ping-pong\n");
+    printf("  %10s %8s %14s %12s\n", "size", "fast", "ns/pair", "coalesces");
+    beavalloc_set_thread_cache(FALSE);
+    beavalloc_set_slabs(FALSE);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (fast = 0; fast < 2; fast++) {
+            struct beavalloc_stats before;
+            struct beavalloc_stats after;
+            void *ptr = NULL;
+            uint64_t t0 = 0;
+            uint64_t ns = 0;
+            uint k = 0;
+
+            beavalloc_set_fast_bins(fast);
+            ptr = beavalloc(sizes[i]);
+            beavalloc_stats(&before);
+            t0 = now_ns();
+            for (k = 0; k < num_ops * 100; k++) {
+                beavfree(ptr);
+                ptr = beavalloc(sizes[i]);
+            }
+            ns = now_ns() - t0;
+            beavalloc_stats(&after);
+            beavfree(ptr);
+            printf("  %10zu %8s %14.1f %12lu\n", sizes[i], fast ? "on" : "off"
+                   , (double) ns / (num_ops * 100)
+                   , (unsigned long) (after.coalesces - before.coalesces));
+            fflush(stdout);
+            beavalloc_reset();
+        }
+    }
+    beavalloc_set_fast_bins(TRUE);
+    beavalloc_set_slabs(TRUE);
+    beavalloc_set_thread_cache(TRUE);
+}
+
+// Allocation throughput from 1 up to max_threads threads, each running
+//   its own alloc/free mix of small blocks, with and without the per-thread
+//   caches in front of the heap.
+static void
+bench_threads(void)
+{
+    static const char *caches[] = {"off", "thread", "cpu"};
+    uint8_t cache = 0;
+
+    printf("threads\n");
+    printf("  %10s %8s %14s %10s\n", "threads", "cache", "Mops/s", "speedup");
+    for (cache = 0; cache < 3; cache++) {
+        double base_rate = 0;
+        uint n = 0;
+
+        // The per-CPU caches sit in front of the thread caches, and are
+        //   skipped without rseq.
+        beavalloc_set_thread_cache(cache != 0);
+        if (cache == 2 && !beavalloc_set_cpu_cache(TRUE)) {
+            break;
+        }
+        for (n = 1; n <= max_threads; n *= 2) {
+            pthread_t threads[n];
+            uint64_t first = UINT64_MAX;
+            uint64_t last = 0;
+            double rate = 0;
+            uint i = 0;
+
+            // Threads are all created before any of them allocate, so the
+            //   thread library's own use of the break stays out of the way.
+            pthread_barrier_init(&start_barrier, NULL, n + 1);
+            for (i = 0; i < n; i++) {
+                pthread_create(&threads[i], NULL, thread_pairs, (void *) (uintptr_t) i);
+            }
+            pthread_barrier_wait(&start_barrier);
+            for (i = 0; i < n; i++) {
+                pthread_join(threads[i], NULL);
+                first = MIN(first, thread_start[i]);
+                last = MAX(last, thread_end[i]);
+            }
+            rate = (double) n * num_ops * 100 * 1000 / (last - first);
+            pthread_barrier_destroy(&start_barrier);
+            if (n == 1) {
+                base_rate = rate;
+            }
+            printf("  %10u %8s %14.2f %10.2f\n", n, caches[cache]
+                   , rate, rate / base_rate);
+            fflush(stdout);
+        }
+    }
+    beavalloc_set_cpu_cache(FALSE);
+    beavalloc_set_thread_cache(TRUE);
+}
+
+static void *
+thread_pairs(void *arg)
+{
+    void *ptrs[64] = {NULL};
+    uint id = (uint) (uintptr_t) arg;
+    uint seed = id;
+    uint i = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    thread_start[id] = now_ns();
+    for (i = 0; i < num_ops * 100; i++) {
+        uint slot = rand_r(&seed) % 64;
+
+        beavfree(ptrs[slot]);
+        ptrs[slot] = beavalloc(16 + rand_r(&seed) % 496);
+    }
+    for (i = 0; i < 64; i++) {
+        beavfree(ptrs[i]);
+    }
+    thread_end[id] = now_ns();
+    return NULL;
+}
+
+// Pairs of threads, one allocating blocks of up to 4 KiB and the other
+//   freeing them, from 1 pair up to max_threads / 2, with and without
+//   remote frees. Without them every free waits on the lock the producer
+//   allocates under.
+static void
+bench_pipelines(void)
+{
+    uint8_t remote = 0;
+
+    printf("producer/consumer\n");
+    printf("  %10s %8s %14s %10s\n", "pairs", "remote", "Mops/s", "speedup");
+    for (remote = 0; remote < 2; remote++) {
+        double base_rate = 0;
+        uint n = 0;
+
+        beavalloc_set_remote_free(remote);
+        for (n = 1; n <= MAX(max_threads / 2, 1) && n <= MAX_PIPELINES; n *= 2) {
+            pthread_t threads[2 * n];
+            uint64_t first = UINT64_MAX;
+            uint64_t last = 0;
+            double rate = 0;
+            uint i = 0;
+
+            pthread_barrier_init(&start_barrier, NULL, 2 * n + 1);
+            for (i = 0; i < n; i++) {
+                pipelines[i].head = 0;
+                pipelines[i].tail = 0;
+                pthread_create(&threads[2 * i], NULL, pipeline_produce, (void *) (uintptr_t) i);
+                pthread_create(&threads[2 * i + 1], NULL, pipeline_consume, (void *) (uintptr_t) i);
+            }
+            pthread_barrier_wait(&start_barrier);
+            for (i = 0; i < 2 * n; i++) {
+                pthread_join(threads[i], NULL);
+                first = MIN(first, thread_start[i]);
+                last = MAX(last, thread_end[i]);
+            }
+            rate = (double) n * num_ops * 100 * 2 * 1000 / (last - first);
+            pthread_barrier_destroy(&start_barrier);
+            if (n == 1) {
+                base_rate = rate;
+            }
+            printf("  %10u %8s %14.2f %10.2f\n", n, remote ? "on" : "off"
+                   , rate, rate / base_rate);
+            fflush(stdout);
+            beavalloc_reset();
+        }
+    }
+    beavalloc_set_remote_free(TRUE);
+}
+
+static void *
+pipeline_produce(void *arg)
+{
+    uint id = (uint) (uintptr_t) arg;
+    struct pipeline *p = &pipelines[id];
+    uint seed = id;
+    uint i = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    thread_start[2 * id] = now_ns();
+    for (i = 0; i < num_ops * 100; i++) {
+        void *ptr = beavalloc(16 + rand_r(&seed) % 4080);
+
+        *(char *) ptr = 1;
+        while (p->head - __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        p->ring[p->head % RING_SIZE] = ptr;
+        __atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+    }
+    thread_end[2 * id] = now_ns();
+    return NULL;
+}
+
+static void *
+pipeline_consume(void *arg)
+{
+    uint id = (uint) (uintptr_t) arg;
+    struct pipeline *p = &pipelines[id];
+    uint i = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    thread_start[2 * id + 1] = now_ns();
+    for (i = 0; i < num_ops * 100; i++) {
+        while (__atomic_load_n(&p->head, __ATOMIC_ACQUIRE) == p->tail) {
+            sched_yield();
+        }
+        beavfree(p->ring[p->tail % RING_SIZE]);
+        __atomic_store_n(&p->tail, p->tail + 1, __ATOMIC_RELEASE);
+    }
+    thread_end[2 * id + 1] = now_ns();
+    return NULL;
+}
+
+// Buffers grown a step at a time up to just under the mmap threshold, the
+//   way string builders and vectors grow. Every time realloc moves a buffer
+//   the old contents are copied, so the moves are counted and the copied
+//   bytes added up. With several buffers they grow in turn and get in each
+//   other's way.
+static void
+bench_realloc_growth(void)
+{
+    static const uint steps[] = {16, 256, 4096};
+    uint s = 0;
+
+    printf("realloc growth\n");
+    printf("  %10s %8s %10s %10s %14s %12s\n"
+           , "step", "buffers", "reallocs", "moves", "bytes copied", "ns/realloc");
+    for (s = 0; s < sizeof(steps) / sizeof(steps[0]); s++) {
+        uint nbuf = 0;
+
+        for (nbuf = 1; nbuf <= 4; nbuf *= 2) {
+            char *bufs[4] = {NULL};
+            size_t sizes[4] = {0};
+            uint64_t copied = 0;
+            uint64_t elapsed = 0;
+            uint reallocs = 0;
+            uint moves = 0;
+            uint i = 0;
+
+            while (sizes[nbuf - 1] + steps[s] < MMAP_THRESHOLD) {
+                for (i = 0; i < nbuf; i++) {
+                    uint64_t t0 = now_ns();
+                    char *ptr = beavrealloc(bufs[i], sizes[i] + steps[s]);
+
+                    elapsed += now_ns() - t0;
+                    if (bufs[i] != NULL && ptr != bufs[i]) {
+                        moves++;
+                        copied += sizes[i];
+                    }
+                    bufs[i] = ptr;
+                    sizes[i] += steps[s];
+                    bufs[i][sizes[i] - 1] = (char) i;
+                    reallocs++;
+                }
+            }
+            printf("  %10u %8u %10u %10u %14lu %12.1f\n", steps[s], nbuf
+                   , reallocs, moves, (unsigned long) copied, (double) elapsed / reallocs);
+            fflush(stdout);
+
+            for (i = 0; i < nbuf; i++) {
+                beavfree(bufs[i]);
+            }
+            beavalloc_reset();
+        }
+    }
+}
+
+// Lots of small nodes, all live at once, with and without slabs. The
+//   memory column is how much the resident set grew per node.
+static void
+bench_small_objects(void)
+{
+    static const uint sizes[] = {16, 32, 64, 128, 256};
+    uint n = num_ops * 256;
+    void **nodes = mmap(NULL, n * sizeof(void *), PROT_READ | PROT_WRITE
+                        , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint8_t slabs = 0;
+    uint s = 0;
+
+    if (nodes == MAP_FAILED) {
+        return;
+    }
+    memset(nodes, 0, n * sizeof(void *));
+    printf("small objects\n");
+    printf("  %10s %8s %10s %14s %14s %14s\n"
+           , "size", "slabs", "objects", "alloc ns/op", "free ns/op", "bytes/object");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (slabs = 0; slabs < 2; slabs++) {
+            size_t rss = rss_bytes();
+            uint64_t t0 = 0;
+            uint64_t t1 = 0;
+            uint64_t t2 = 0;
+            double per_object = 0;
+            uint i = 0;
+
+            beavalloc_set_slabs(slabs);
+            t0 = now_ns();
+            for (i = 0; i < n; i++) {
+                nodes[i] = beavalloc(sizes[s]);
+                *(char *) nodes[i] = 1;
+            }
+            t1 = now_ns();
+            per_object = (double) (rss_bytes() - rss) / n;
+            for (i = 0; i < n; i++) {
+                beavfree(nodes[i]);
+            }
+            t2 = now_ns();
+            printf("  %10u %8s %10u %14.1f %14.1f %14.1f\n", sizes[s], slabs ? "on" : "off"
+                   , n, (double) (t1 - t0) / n, (double) (t2 - t1) / n, per_object);
+            fflush(stdout);
+            beavalloc_reset();
+        }
+    }
+    beavalloc_set_slabs(TRUE);
+    munmap(nodes, n * sizeof(void *));
+}
+
+static const struct allocator allocators[] = {
+    {"beavalloc", beavalloc, beavfree, beavcalloc, beavrealloc},
+    {"malloc", malloc, free, calloc, realloc},
+};
+
+static const struct scenario scenarios[] = {
+    {"pairs", scenario_pairs},
+    {"churn", scenario_churn},
+    {"prodcons", scenario_prodcons},
+    {"realloc", scenario_realloc},
+    {"calloc", scenario_calloc},
+    {"frag", scenario_frag},
+};
+
+// Every scenario against every allocator, each run in a child of its own
+//   so peak RSS belongs to that run alone and the two allocators never
+//   share a heap. Overhead is the peak RSS the run added over the most
+//   bytes it had live at once, so 1.00 is a perfect fit. With -P only
+//   beavalloc runs, named by its placement policy, for make policies to
+//   set the builds side by side.
+static void
+bench_scenarios(void)
+{
+    uint count = policy_rows ? 1 : sizeof(allocators) / sizeof(allocators[0]);
+    uint i = 0;
+    uint j = 0;
+
+    if (!policy_rows) {
+        printf("scenarios\n");
+    }
+    printf("  %-10s %-10s %10s %8s %8s %8s %10s %9s\n"
+           , "scenario", policy_rows ? "policy" : "allocator", "Mops/s"
+           , "p50 ns", "p99 ns", "p999 ns", "peak KiB", "overhead");
+    fflush(stdout);
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        for (j = 0; j < count; j++) {
+            pid_t pid = fork();
+
+            if (pid == 0) {
+                run_scenario(&scenarios[i], &allocators[j]);
+                fflush(stdout);
+                _exit(0);
+            }
+            if (pid > 0) {
+                waitpid(pid, NULL, 0);
+            }
+        }
+    }
+}
+
+static void
+run_scenario(const struct scenario *sc, const struct allocator *a)
+{
+    static struct latency lat;
+    struct rusage usage;
+    size_t base = rss_bytes();
+    uint64_t t0 = now_ns();
+    size_t ops = sc->run(a, &lat);
+    uint64_t elapsed = now_ns() - t0;
+    double peak = 0;
+
+    getrusage(RUSAGE_SELF, &usage);
+    peak = (double) usage.ru_maxrss * 1024;
+    printf("  %-10s %-10s %10.2f %8lu %8lu %8lu %10ld"
+           , sc->name, policy_rows ? POLICY_NAME : a->name, (double) ops * 1000 / elapsed
+           , (unsigned long) lat_percentile(&lat, 0.5)
+           , (unsigned long) lat_percentile(&lat, 0.99)
+           , (unsigned long) lat_percentile(&lat, 0.999)
+           , usage.ru_maxrss);
+    // A few live bytes against the fixed cost of the process says nothing.
+    if (peak_bytes < 256 * 1024) {
+        printf(" %9s\n", "-");
+    }
+    else {
+        printf(" %9.2f\n", (peak - base) / peak_bytes);
+    }
+}
+
+static void
+lat_record(struct latency *lat, uint64_t ns)
+{
+    uint log2 = 0;
+    uint i = 0;
+
+    if (ns < LAT_SUBBUCKETS) {
+        i = ns;
+    }
+    else {
+        log2 = 63 - __builtin_clzl(ns);
+        i = (log2 - 3) * LAT_SUBBUCKETS + ((ns >> (log2 - 4)) & (LAT_SUBBUCKETS - 1));
+    }
+    lat->count[MIN(i, LAT_BUCKETS - 1)]++;
+    lat->ops++;
+}
+
+// The low end of the bucket holding the p'th latency.
+static uint64_t
+lat_percentile(const struct latency *lat, double p)
+{
+    uint64_t want = (uint64_t) (p * lat->ops);
+    uint64_t seen = 0;
+    uint i = 0;
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += lat->count[i];
+        if (seen > want) {
+            break;
+        }
+    }
+    if (i < LAT_SUBBUCKETS) {
+        return i;
+    }
+    return (uint64_t) (LAT_SUBBUCKETS + i % LAT_SUBBUCKETS) << (i / LAT_SUBBUCKETS - 1);
+}
+
+static void
+live_add(size_t size)
+{
+    uint64_t bytes = __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+
+    if (bytes > peak_bytes) {
+        peak_bytes = bytes;
+    }
+}
+
+static void
+live_sub(size_t size)
+{
+    __atomic_sub_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+}
+
+// Allocate and free the same 64 bytes over and over.
+static size_t
+scenario_pairs(const struct allocator *a, struct latency *lat)
+{
+    size_t n = (size_t) num_ops * 100;
+    size_t i = 0;
+
+    for (i = 0; i < n; i++) {
+        uint64_t t0 = now_ns();
+        void *ptr = a->alloc(64);
+        uint64_t t1 = now_ns();
+
+        *(char *) ptr = 1;
+        live_add(64);
+        a->free(ptr);
+        live_sub(64);
+        lat_record(lat, t1 - t0);
+        lat_record(lat, now_ns() - t1);
+    }
+    return 2 * n;
+}
+
+// Replace randomly picked blocks of a live set with blocks of random size.
+static size_t
+scenario_churn(const struct allocator *a, struct latency *lat)
+{
+    static size_t sizes[MAX_LIVE];
+    size_t n = (size_t) num_ops * 100;
+    uint seed = 1;
+    size_t i = 0;
+
+    memset(live, 0, sizeof(live));
+    for (i = 0; i < n; i++) {
+        uint slot = rand_r(&seed) % 4096;
+        size_t size = 16 + rand_r(&seed) % 4080;
+        uint64_t t0 = 0;
+
+        if (live[slot] != NULL) {
+            t0 = now_ns();
+            a->free(live[slot]);
+            lat_record(lat, now_ns() - t0);
+            live_sub(sizes[slot]);
+        }
+        t0 = now_ns();
+        live[slot] = a->alloc(size);
+        lat_record(lat, now_ns() - t0);
+        memset(live[slot], 1, MIN(size, 64));
+        sizes[slot] = size;
+        live_add(size);
+    }
+    for (i = 0; i < 4096; i++) {
+        a->free(live[i]);
+    }
+    return 2 * n;
+}
+
+static const struct allocator *consumer_allocator = NULL;
+static struct latency consumer_lat;
+
+// One thread allocates, another frees everything it is handed, so every
+//   free is of a block some other thread allocated.
+static size_t
+scenario_prodcons(const struct allocator *a, struct latency *lat)
+{
+    size_t n = (size_t) num_ops * 100;
+    uint seed = 1;
+    pthread_t consumer;
+    size_t i = 0;
+
+    consumer_allocator = a;
+    pthread_create(&consumer, NULL, thread_consumer, (void *) n);
+    for (i = 0; i < n; i++) {
+        size_t size = 16 + rand_r(&seed) % 1008;
+        uint64_t t0 = now_ns();
+        void *ptr = a->alloc(size);
+
+        lat_record(lat, now_ns() - t0);
+        *(char *) ptr = 1;
+        live_add(size);
+        while (ring_head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        ring[ring_head % RING_SIZE] = ptr;
+        ring_size[ring_head % RING_SIZE] = size;
+        __atomic_store_n(&ring_head, ring_head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(consumer, NULL);
+
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        lat->count[i] += consumer_lat.count[i];
+    }
+    lat->ops += consumer_lat.ops;
+    return 2 * n;
+}
+
+static void *
+thread_consumer(void *arg)
+{
+    size_t n = (size_t) arg;
+    size_t i = 0;
+
+    for (i = 0; i < n; i++) {
+        uint64_t t0 = 0;
+
+        while (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == ring_tail) {
+            sched_yield();
+        }
+        t0 = now_ns();
+        consumer_allocator->free(ring[ring_tail % RING_SIZE]);
+        lat_record(&consumer_lat, now_ns() - t0);
+        live_sub(ring_size[ring_tail % RING_SIZE]);
+        __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Grow 16 buffers by random steps in turn, starting over at 64 KiB.
+static size_t
+scenario_realloc(const struct allocator *a, struct latency *lat)
+{
+    char *bufs[16] = {NULL};
+    size_t sizes[16] = {0};
+    size_t n = (size_t) num_ops * 50;
+    uint seed = 1;
+    size_t i = 0;
+
+    for (i = 0; i < n; i++) {
+        uint b = i % 16;
+        size_t size = sizes[b] + 1 + rand_r(&seed) % 512;
+        uint64_t t0 = 0;
+
+        if (size > 64 * 1024) {
+            a->free(bufs[b]);
+            live_sub(sizes[b]);
+            bufs[b] = NULL;
+            sizes[b] = 0;
+            size = 1 + rand_r(&seed) % 512;
+        }
+        t0 = now_ns();
+        bufs[b] = bufs[b] == NULL ? a->alloc(size) : a->realloc(bufs[b], size);
+        lat_record(lat, now_ns() - t0);
+        bufs[b][size - 1] = 1;
+        live_add(size - sizes[b]);
+        sizes[b] = size;
+    }
+    for (i = 0; i < 16; i++) {
+        a->free(bufs[i]);
+    }
+    return n;
+}
+
+// calloc() and free() of random sizes up to 8 KiB.
+static size_t
+scenario_calloc(const struct allocator *a, struct latency *lat)
+{
+    void *ptrs[64] = {NULL};
+    size_t sizes[64] = {0};
+    size_t n = (size_t) num_ops * 100;
+    uint seed = 1;
+    size_t i = 0;
+
+    for (i = 0; i < n; i++) {
+        uint slot = rand_r(&seed) % 64;
+        size_t size = 16 + rand_r(&seed) % 8176;
+        uint64_t t0 = 0;
+
+        if (ptrs[slot] != NULL) {
+            t0 = now_ns();
+            a->free(ptrs[slot]);
+            lat_record(lat, now_ns() - t0);
+            live_sub(sizes[slot]);
+        }
+        t0 = now_ns();
+        ptrs[slot] = a->calloc(1, size);
+        lat_record(lat, now_ns() - t0);
+        sizes[slot] = size;
+        live_add(size);
+    }
+    for (i = 0; i < 64; i++) {
+        a->free(ptrs[i]);
+    }
+    return 2 * n;
+}
+
+// The frag scenario on its own, with how the heap was left at the end:
+//   the most core it held over the most bytes live at once, how much of
+//   it was in free blocks, and how many blocks that was split into. The
+//   run is seeded, so every policy's build sees the same calls.
+static void
+bench_fragmentation(void)
+{
+    static struct latency lat;
+    uint64_t t0 = 0;
+    uint64_t elapsed = 0;
+    size_t ops = 0;
+
+    printf("fragmentation\n");
+    printf("  %-10s %10s %12s %12s %9s %10s %12s\n"
+           , "placement", "ns/op", "peak live", "peak core", "overhead"
+           , "free %", "free blocks");
+    beavalloc_reset();
+    live_bytes = 0;
+    peak_bytes = 0;
+    t0 = now_ns();
+    ops = scenario_frag(&allocators[0], &lat);
+    elapsed = now_ns() - t0;
+
+    printf("  %-10s %10.1f %12lu %12zu %9.2f %10.1f %12lu\n"
+           , POLICY_NAME, (double) elapsed / ops
+           , (unsigned long) peak_bytes / 1024, frag_stats.peak_mapped / 1024
+           , (double) frag_stats.peak_mapped / peak_bytes
+           , 100.0 * frag_stats.free / frag_stats.mapped, (unsigned long) frag_stats.free_blocks);
+    fflush(stdout);
+    beavalloc_reset();
+}
+
+// Each phase frees a random half of the live set and refills it from a
+//   size mix shifted from the last one's, which leaves holes the new
+//   sizes fit badly. Every page of a block is written, so the resident
+//   set shows what the holes cost.
+static size_t
+scenario_frag(const struct allocator *a, struct latency *lat)
+{
+    static size_t sizes[MAX_LIVE];
+    uint slots = MIN(MAX_LIVE, 8192);
+    uint phases = 16;
+    uint seed = 1;
+    size_t ops = 0;
+    size_t off = 0;
+    uint phase = 0;
+    uint i = 0;
+
+    memset(live, 0, sizeof(live));
+    for (phase = 0; phase < phases; phase++) {
+        for (i = 0; i < slots; i++) {
+            if (live[i] != NULL && rand_r(&seed) % 2) {
+                uint64_t t0 = now_ns();
+
+                a->free(live[i]);
+                lat_record(lat, now_ns() - t0);
+                live[i] = NULL;
+                live_sub(sizes[i]);
+                ops++;
+            }
+        }
+        for (i = 0; i < slots; i++) {
+            if (live[i] == NULL) {
+                uint64_t t0 = 0;
+
+                sizes[i] = frag_size(&seed, phase);
+                t0 = now_ns();
+                live[i] = a->alloc(sizes[i]);
+                lat_record(lat, now_ns() - t0);
+                for (off = 0; off < sizes[i]; off += 4096) {
+                    ((char *) live[i])[off] = 1;
+                }
+                live_add(sizes[i]);
+                ops++;
+            }
+        }
+    }
+
+    if (a->alloc == beavalloc) {
+        beavalloc_stats(&frag_stats);
+    }
+    for (i = 0; i < slots; i++) {
+        a->free(live[i]);
+    }
+    return ops;
+}
+
+// Mostly small blocks with a tail of large ones, log uniform within each
+//   band. The bands drift up with the phase and start again every four.
+static size_t
+frag_size(uint *seed, uint phase)
+{
+    uint pick = rand_r(seed) % 100;
+    uint shift = phase % 4;
+    uint lo = 0;
+    uint hi = 0;
+    uint e = 0;
+
+    if (pick < 60) {
+        lo = 4;
+        hi = 9;
+    }
+    else if (pick < 90) {
+        lo = 9;
+        hi = 13;
+    }
+    else {
+        lo = 13;
+        hi = 16;
+    }
+    lo += shift / 2;
+    hi = MIN(hi + shift / 2, 16);
+    e = lo + rand_r(seed) % (hi - lo);
+    return ((size_t) 1 << e) + rand_r(seed) % ((size_t) 1 << e);
+}
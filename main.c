@@ -1,5 +1,11 @@
 // R. Jesse Chaney
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE                // sched_getcpu()
+#endif // _GNU_SOURCE
+
+#include <limits.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -15,12 +21,27 @@
 # define NUM_PTRS 100
 #endif // NUM_PTRS
 
+#ifndef NUM_THREADS
+# define NUM_THREADS 8
+#endif // NUM_THREADS
+
 #define OPTIONS "hvt:"
 
 extern char end, etext, edata;
 uint test_number = 0;
+pthread_barrier_t churn_barrier;
+pthread_key_t exit_key;
+pthread_once_t exit_once = PTHREAD_ONCE_INIT;
 
 void run_tests(void);
+void *thread_churn(void *arg);
+void *thread_realloc_churn(void *arg);
+void *thread_free_all(void *arg);
+void *thread_exit_cached(void *arg);
+void exit_churn(void *arg);
+void exit_key_create(void);
+void *prof_site_a(size_t size) __attribute__((noinline));
+void *prof_site_b(size_t size) __attribute__((noinline));
 
 int
 main(int argc, char **argv)
@@ -68,6 +89,13 @@ run_tests(void)
         fprintf(stderr, "  running only test %d\n", test_number);
     }
 
+    // Most tests look at the heap block by block, so every request has to
+    //   reach the heap rather than stop in the thread cache, a slab or a
+    //   fast bin.
+    beavalloc_set_thread_cache(FALSE);
+    beavalloc_set_slabs(FALSE);
+    beavalloc_set_fast_bins(FALSE);
+
     // Get the beginning address of the start of the stack.
     base = sbrk(0);
     fprintf(stderr, "base: %p\n", base);
@@ -732,11 +760,1606 @@ run_tests(void)
         }
         fprintf(stderr, "*** End %d\n", 21);
     }
+    if (test_number == 0 || test_number == 22) {
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *ptr4 = NULL;
+        char *ptr5 = NULL;
 
-    if (test_number == 0) {
-        fprintf(stderr, "\n\nWoooooooHooooooo!!! All tests done and you survived.\n\n\t %c[5m Make sure they are correct. %c[0m \n\n\n", 27, 27);
+        fprintf(stderr, "*** Begin %d\n", 22);
+        fprintf(stderr, "      free bins\n");
+
+        ptr1 = beavalloc(2000);
+        ptr2 = beavalloc(2000);
+        ptr3 = beavalloc(2000);
+        assert(((uintptr_t) ptr1 % ALIGNMENT) == 0);
+        assert(((uintptr_t) ptr2 % ALIGNMENT) == 0);
+
+        beavfree(ptr2);
+        beavalloc_dump(FALSE);
+
+        // The freed space is found from its bin and split.
+        ptr4 = beavalloc(1500);
+        assert(ptr1 < ptr4 && ptr4 < ptr3);
+        ptr5 = beavalloc(300);
+        assert(ptr4 < ptr5 && ptr5 < ptr3);
+        beavalloc_dump(FALSE);
+
+        beavfree(ptr5);
+        beavfree(ptr4);
+        ptr4 = beavalloc(2000);
+        assert(ptr1 < ptr4 && ptr4 < ptr3);
+        beavfree(ptr1);
+        beavfree(ptr3);
+        beavfree(ptr4);
+        beavalloc_dump(FALSE);
+
+        // Everything coalesced back into one block.
+        ptr5 = beavalloc(6000);
+        assert(ptr5 == ptr1);
+        beavfree(ptr5);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 22);
     }
-    else {
-        fprintf(stderr, "\n\nWoooooooHooooooo!!! You survived test %d.\n\n\t %c[5m Make sure it is correct. %c[0m \n\n\n", test_number, 27, 27);
+    if (test_number == 0 || test_number == 23) {
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char stack_buf[64] = {0};
+        size_t page = sysconf(_SC_PAGESIZE);
+        char *foreign = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 23);
+        fprintf(stderr, "      bad pointers\n");
+
+        ptr1 = beavalloc(100);
+        ptr2 = beavalloc(100);
+        memset(ptr1, 0x1, 100);
+
+        // None of these are blocks, they must all be ignored.
+        beavfree(stack_buf);
+        beavfree(ptr1 + 1);
+        beavfree(ptr1 + 16);
+        beavfree(base - 64);
+        assert(beavrealloc(stack_buf, 10) == NULL);
+        assert(beavrealloc(ptr1 + 32, 10) == NULL);
+
+        // Nor is memory mapped by someone else, even where a mapped
+        //   block's data could start and with nothing mapped before it.
+        foreign = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE
+                       , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(foreign != MAP_FAILED);
+        munmap(foreign, page);
+        foreign += page;
+        beavfree(foreign);
+        beavfree(foreign + sizeof(struct mmap_block));
+        beavfree(foreign + 64);
+        assert(beavrealloc(foreign, 10) == NULL);
+        assert(beavalloc_usable_size(foreign + 1024) == 0);
+        munmap(foreign, page);
+
+        // A block swallowed by coalescing is not a block any more.
+        beavfree(ptr2);
+        beavfree(ptr1);
+        beavfree(ptr2);
+        assert(beavrealloc(ptr2, 10) == NULL);
+
+        ptr3 = beavalloc(100);
+        assert(ptr3 == ptr1);
+        beavalloc_dump(FALSE);
+        beavfree(ptr3);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 23);
+    }
+    if (test_number == 0 || test_number == 24) {
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *foreign = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 24);
+        fprintf(stderr, "      boundary tags\n");
+
+        assert(META_DATA <= 16);
+
+        ptr1 = beavalloc(10);
+        ptr2 = beavalloc(2000);
+        assert(ptr2 - ptr1 < 1024);
+
+        // Someone else moves the break, the heap must step over it.
+        foreign = sbrk(4096);
+        memset(foreign, 0x7, 4096);
+        ptr3 = beavalloc(3000);
+        assert(foreign < ptr3);
+        memset(ptr3, 0x3, 3000);
+        beavalloc_dump(FALSE);
+
+        beavfree(ptr2);
+        beavfree(ptr3);
+        beavfree(ptr1);
+        beavalloc_dump(FALSE);
+        assert(foreign[0] == 0x7 && foreign[4095] == 0x7);
+
+        // Everything on either side of the fence is one free block again.
+        ptr1 = beavalloc(900);
+        ptr3 = beavalloc(5000);
+        assert(ptr1 < foreign);
+        assert(foreign < ptr3);
+        beavfree(ptr1);
+        beavfree(ptr3);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 24);
+    }
+    if (test_number == 0 || test_number == 25) {
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 25);
+        fprintf(stderr, "      thread cache\n");
+
+        beavalloc_set_thread_cache(TRUE);
+
+        ptr1 = beavalloc(100);
+        ptr2 = beavalloc(100);
+        beavfree(ptr1);
+        beavalloc_dump(FALSE);
+
+        // Cached blocks come back LIFO and cannot be freed twice.
+        beavfree(ptr1);
+        ptr3 = beavalloc(100);
+        assert(ptr3 == ptr1);
+        ptr1 = beavalloc(100);
+        assert(ptr1 != ptr3);
+        assert(ptr1 != ptr2);
+
+        beavfree(ptr1);
+        beavfree(ptr2);
+        beavfree(ptr3);
+
+        // Turning the cache off hands its blocks back to the heap.
+        beavalloc_set_thread_cache(FALSE);
+        beavalloc_dump(FALSE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 25);
+    }
+    if (test_number == 0 || test_number == 26) {
+        pthread_t threads[NUM_THREADS];
+        long i = 0;
+        char *ptr1 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 26);
+        fprintf(stderr, "      threads\n");
+
+        // pthread_create() can move the break for the thread library's own
+        //   use, so hold the threads back until they all exist and the heap
+        //   starts above that.
+        beavalloc_set_thread_cache(TRUE);
+        beavalloc_set_slabs(TRUE);
+        pthread_barrier_init(&churn_barrier, NULL, NUM_THREADS + 1);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_create(&threads[i], NULL, thread_churn, (void *) i);
+        }
+        base = sbrk(0);
+        pthread_barrier_wait(&churn_barrier);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_barrier_destroy(&churn_barrier);
+        beavalloc_set_thread_cache(FALSE);
+        beavalloc_set_slabs(FALSE);
+        beavalloc_dump(TRUE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 26);
+    }
+    if (test_number == 0 || test_number == 27) {
+        struct beavalloc_arena *arena1 = NULL;
+        struct beavalloc_arena *arena2 = NULL;
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *ptr4 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 27);
+        fprintf(stderr, "      arenas\n");
+
+        base = sbrk(0);
+        arena1 = beavalloc_arena_create();
+        arena2 = beavalloc_arena_create();
+        assert(arena1 != NULL);
+        assert(arena2 != NULL);
+        assert(arena1 != arena2);
+
+        // Arenas never touch the break.
+        ptr1 = beavalloc_arena_alloc(arena1, 100);
+        ptr2 = beavalloc_arena_alloc(arena1, 5000);
+        ptr3 = beavalloc_arena_alloc(arena2, 100);
+        assert(ptr1 != NULL && ptr2 != NULL && ptr3 != NULL);
+        assert(sbrk(0) == base);
+        memset(ptr1, 1, 100);
+        memset(ptr2, 2, 5000);
+        memset(ptr3, 3, 100);
+        beavalloc_dump(FALSE);
+
+        // A block only goes back to the arena it came from.
+        // Freed, ptr1 would join the rest of the first growth, the only
+        //   free block big enough for this.
+        beavalloc_arena_free(arena2, ptr1);
+        ptr4 = beavalloc_arena_alloc(arena1, GROW_MIN - 200);
+        assert(ptr4 != ptr1);
+        beavalloc_arena_free(arena1, ptr4);
+        beavalloc_arena_free(arena1, ptr1);
+        beavalloc_arena_free(arena1, ptr1);
+        ptr4 = beavalloc_arena_alloc(arena1, GROW_MIN - 200);
+        assert(ptr4 == ptr1);
+        memset(ptr1, 1, 100);
+
+        // beavfree() and beavrealloc() find the arena themselves.
+        ptr4 = beavalloc_arena_alloc(arena1, 200);
+        beavfree(ptr4);
+        ptr2 = beavrealloc(ptr2, 10000);
+        assert(ptr2[4999] == 2);
+        beavfree(ptr2);
+
+        // A reset leaves user arenas alone.
+        beavalloc_reset();
+        assert(ptr3[99] == 3);
+        beavalloc_dump(TRUE);
+
+        // Destroying arena2 does not disturb arena1.
+        beavalloc_arena_destroy(arena2);
+        beavfree(ptr3);
+        assert(ptr1[0] == 1);
+        beavalloc_arena_destroy(arena1);
+
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 27);
+    }
+    if (test_number == 0 || test_number == 28) {
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 28);
+        fprintf(stderr, "      mapped blocks\n");
+
+        // Large blocks are mapped and never move the break.
+        ptr1 = beavalloc(MMAP_THRESHOLD);
+        ptr2 = beavalloc(1000);
+        assert(ptr1 != NULL && ptr2 != NULL);
+        assert((void *) ptr1 >= sbrk(0) || (void *) ptr1 < (void *) base);
+        memset(ptr1, 1, MMAP_THRESHOLD);
+        beavalloc_dump(FALSE);
+
+        // Growing a mapped block keeps its contents.
+        ptr1 = beavrealloc(ptr1, 16 * MMAP_THRESHOLD);
+        assert(ptr1 != NULL);
+        assert(ptr1[0] == 1 && ptr1[MMAP_THRESHOLD - 1] == 1);
+        memset(ptr1, 2, 16 * MMAP_THRESHOLD);
+
+        // A heap block grown past the threshold moves to a mapping.
+        memset(ptr2, 3, 1000);
+        ptr3 = beavrealloc(ptr2, 2 * MMAP_THRESHOLD);
+        assert(ptr3 != NULL && ptr3[999] == 3);
+
+        // Freed mappings are gone, so a second free is ignored.
+        beavfree(ptr1);
+        beavfree(ptr1);
+        assert(beavrealloc(ptr1, 10) == NULL);
+        beavfree(ptr3);
+        beavalloc_dump(TRUE);
+
+        // With the threshold off large blocks come from the heap again.
+        beavalloc_set_mmap_threshold(0);
+        ptr1 = beavalloc(MMAP_THRESHOLD);
+        assert((void *) ptr1 > (void *) base && (void *) ptr1 < sbrk(0));
+        beavfree(ptr1);
+        beavalloc_set_mmap_threshold(MMAP_THRESHOLD);
+
+        // Reset unmaps whatever is left.
+        ptr1 = beavalloc(MMAP_THRESHOLD);
+        beavalloc_reset();
+        beavalloc_dump(TRUE);
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 28);
+    }
+    if (test_number == 0 || test_number == 29) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        unsigned char resident = 0;
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *top = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 29);
+        fprintf(stderr, "      trimming\n");
+
+        // Below the trim threshold the break stays put until asked.
+        ptr1 = beavalloc(100);
+        ptr2 = beavalloc(TRIM_THRESHOLD / 2);
+        top = sbrk(0);
+        beavfree(ptr2);
+        assert(sbrk(0) == top);
+        assert(beavalloc_trim(0) == 1);
+        assert((char *) sbrk(0) < top);
+        assert(beavalloc_trim(0) == 0);
+        beavalloc_dump(FALSE);
+
+        // Above it freeing the top block lowers the break.
+        beavalloc_set_trim_threshold(TRIM_THRESHOLD / 4);
+        ptr2 = beavalloc(TRIM_THRESHOLD / 2);
+        top = sbrk(0);
+        beavfree(ptr2);
+        assert((char *) sbrk(0) < top);
+
+        // A large free block below the top keeps its links and footer but
+        //   not its pages.
+        ptr2 = beavalloc(TRIM_THRESHOLD / 2);
+        ptr3 = beavalloc(100);
+        memset(ptr2, 1, TRIM_THRESHOLD / 2);
+        beavfree(ptr2);
+        top = (char *) (((uintptr_t) ptr2 + 2 * page) & ~(page - 1));
+        mincore(top, page, &resident);
+        assert((resident & 1) == 0);
+        beavalloc_dump(FALSE);
+
+        beavalloc_set_trim_threshold(TRIM_THRESHOLD);
+        beavfree(ptr1);
+        beavfree(ptr3);
+        beavalloc_dump(TRUE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 29);
+    }
+    if (test_number == 0 || test_number == 30) {
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *ptr4 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 30);
+        fprintf(stderr, "      realloc in place\n");
+
+        ptr1 = beavalloc(500);
+        ptr2 = beavalloc(500);
+        ptr3 = beavalloc(500);
+        memset(ptr1, 1, 500);
+
+        // A free right neighbour is taken in.
+        beavfree(ptr2);
+        ptr4 = beavrealloc(ptr1, 900);
+        assert(ptr4 == ptr1);
+        assert(ptr4[499] == 1);
+        beavalloc_dump(FALSE);
+
+        // Not enough room before the next used block means a move.
+        ptr4 = beavrealloc(ptr1, 3000);
+        assert(ptr4 != ptr1);
+        assert(ptr4[499] == 1);
+
+        // The block at the top of the heap grows by moving the break.
+        ptr1 = beavrealloc(ptr4, 20000);
+        assert(ptr1 == ptr4);
+        assert(ptr1[499] == 1);
+        ptr1[19999] = 1;
+        beavalloc_dump(FALSE);
+
+        beavfree(ptr1);
+        beavfree(ptr3);
+        beavalloc_dump(TRUE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 30);
+    }
+    if (test_number == 0 || test_number == 31) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        unsigned char resident = 0;
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *top = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 31);
+        fprintf(stderr, "      realloc shrink\n");
+
+        // The tail of a shrunk block is free for the next request.
+        ptr1 = beavalloc(20000);
+        ptr2 = beavalloc(100);
+        memset(ptr1, 1, 20000);
+        assert(beavrealloc(ptr1, 100) == ptr1);
+        assert(ptr1[99] == 1);
+        ptr3 = beavalloc(10000);
+        assert(ptr3 > ptr1 && ptr3 < ptr2);
+        beavalloc_dump(FALSE);
+        beavfree(ptr3);
+
+        // It joins a free right neighbour.
+        beavfree(ptr2);
+        ptr3 = beavalloc(200);
+        assert(beavrealloc(ptr3, 40) == ptr3);
+        beavalloc_dump(FALSE);
+        beavfree(ptr3);
+
+        // A small step down leaves the block whole; a page off a large
+        //   block is still cut away.
+        ptr3 = beavalloc(1000);
+        assert(beavrealloc(ptr3, 900) == ptr3);
+        assert(beavalloc_usable_size(ptr3) == 1008);
+        assert(beavrealloc(ptr3, 500) == ptr3);
+        assert(beavalloc_usable_size(ptr3) == 512);
+        beavfree(ptr3);
+        ptr3 = beavalloc(64 * 1024);
+        assert(beavrealloc(ptr3, 60 * 1024) == ptr3);
+        assert(beavalloc_usable_size(ptr3) == 60 * 1024);
+        beavfree(ptr3);
+
+        // At the top of the heap a large tail goes back to the kernel.
+        beavalloc_set_trim_threshold(TRIM_THRESHOLD / 4);
+        ptr2 = beavalloc(TRIM_THRESHOLD / 2);
+        top = sbrk(0);
+        assert(beavrealloc(ptr2, 100) == ptr2);
+        assert((char *) sbrk(0) < top);
+        beavalloc_set_trim_threshold(TRIM_THRESHOLD);
+
+        // So do the pages past the new end of a mapped block.
+        ptr3 = beavalloc(8 * MMAP_THRESHOLD);
+        assert(beavrealloc(ptr3, 100) == ptr3);
+        assert(mincore((void *) (((uintptr_t) ptr3 + 2 * page) & ~(page - 1))
+                       , page, &resident) == -1);
+        ptr3[99] = 1;
+
+        beavfree(ptr1);
+        beavfree(ptr2);
+        beavfree(ptr3);
+        beavalloc_dump(TRUE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 31);
+    }
+    if (test_number == 0 || test_number == 32) {
+        char *ptrs[NUM_PTRS] = {NULL};
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 32);
+        fprintf(stderr, "      slabs\n");
+
+        beavalloc_set_slabs(TRUE);
+
+        // Small objects sit back to back with no header and leave the
+        //   break alone; larger ones still come from the heap.
+        ptr1 = beavalloc(24);
+        ptr2 = beavalloc(24);
+        assert(ptr2 == ptr1 + 32);
+        assert(sbrk(0) == base);
+        ptr1[23] = 1;
+        ptr2[0] = 2;
+        ptr3 = beavalloc(3000);
+        assert(ptr3 < (char *) sbrk(0));
+        beavalloc_dump(FALSE);
+
+        // Freed objects are reused, and only freed once.
+        beavfree(ptr1);
+        beavfree(ptr1);
+        beavfree(ptr2 + 8);
+        assert(beavalloc(20) == ptr1);
+
+        // Growing past the class moves the object.
+        ptr1[0] = 3;
+        ptr1 = beavrealloc(ptr1, 20);
+        ptr1 = beavrealloc(ptr1, 100);
+        assert(ptr1 != ptr2 - 32 && ptr1[0] == 3);
+
+        // The object it left is free, so it cannot be resized or freed.
+        assert(beavrealloc(ptr2 - 32, 10) == NULL);
+        assert(beavrealloc(ptr2 - 32, 100) == NULL);
+        beavfree(ptr2 - 32);
+
+        // Enough objects to fill more than one slab of a class.
+        for (i = 0; i < NUM_PTRS; i++) {
+            ptrs[i] = beavalloc(200);
+            memset(ptrs[i], i, 200);
+        }
+        for (i = 0; i < NUM_PTRS; i++) {
+            assert(ptrs[i][199] == (char) i);
+            beavfree(ptrs[i]);
+        }
+        beavfree(ptr1);
+        beavfree(ptr2);
+        beavfree(ptr3);
+        beavalloc_dump(TRUE);
+
+        beavalloc_set_slabs(FALSE);
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 32);
+    }
+    if (test_number == 0 || test_number == 33) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        void *ptr = NULL;
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *ptr4 = NULL;
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 33);
+        fprintf(stderr, "      aligned\n");
+
+        ptr1 = beavalloc(10);
+        ptr2 = beavalloc_aligned(64, 100);
+        ptr3 = beavmemalign(page, 3000);
+        ptr4 = beavaligned_alloc(32, 64);
+        assert(ptr2 != NULL && (uintptr_t) ptr2 % 64 == 0);
+        assert(ptr3 != NULL && (uintptr_t) ptr3 % page == 0);
+        assert(ptr4 != NULL && (uintptr_t) ptr4 % 32 == 0);
+        memset(ptr2, 2, 100);
+        memset(ptr3, 3, 3000);
+        beavalloc_dump(FALSE);
+
+        // Bad alignments are refused.
+        errno = 0;
+        assert(beavalloc_aligned(48, 100) == NULL && errno == EINVAL);
+        assert(beavposix_memalign(&ptr, 4, 100) == EINVAL);
+        assert(beavposix_memalign(&ptr, 0, 100) == EINVAL);
+        assert(beavposix_memalign(&ptr, 256, 100) == 0);
+        assert((uintptr_t) ptr % 256 == 0);
+        beavfree(ptr);
+
+        // Large aligned blocks get a mapping of their own, which keeps
+        //   them off the heap and can still be grown and freed.
+        for (i = 5; i <= 21; i += 4) {
+            char *brk = sbrk(0);
+
+            ptr = beavalloc_aligned(1UL << i, MMAP_THRESHOLD);
+            assert(ptr != NULL && (uintptr_t) ptr % (1UL << i) == 0);
+            assert(sbrk(0) == brk && beavalloc_usable_size(ptr) >= MMAP_THRESHOLD);
+            memset(ptr, 5, MMAP_THRESHOLD);
+            ptr = beavrealloc(ptr, 4 * MMAP_THRESHOLD);
+            assert(ptr != NULL && ((char *) ptr)[MMAP_THRESHOLD - 1] == 5);
+            beavfree(ptr);
+            assert(sbrk(0) == brk);
+        }
+
+        // The slack in front of an aligned block is free for others.
+        ptr = beavalloc(3000);
+        assert((char *) ptr < ptr3);
+
+        beavfree(ptr);
+        beavfree(ptr1);
+        beavfree(ptr2);
+        beavfree(ptr3);
+        beavfree(ptr4);
+        beavalloc_dump(FALSE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 33);
     }
+
+    if (test_number == 0 || test_number == 34) {
+        char path[] = "/tmp/beavtraceXXXXXX";
+        struct beavalloc_trace_rec rec;
+        FILE *in = NULL;
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *ptr4 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 34);
+        fprintf(stderr, "      trace\n");
+
+        // stdio may move the break for its own use, so the trace is
+        //   opened for reading before the heap starts.
+        close(mkstemp(path));
+        in = fopen(path, "r");
+        assert(in != NULL);
+        base = sbrk(0);
+
+        assert(beavalloc_trace_start(path) == 0);
+        errno = 0;
+        assert(beavalloc_trace_start(path) == -1 && errno == EBUSY);
+        ptr1 = beavalloc(100);
+        ptr2 = beavcalloc(10, 30);
+        ptr3 = beavrealloc(ptr2, 1000);
+        ptr4 = beavalloc_aligned(64, 200);
+        beavfree(ptr1);
+        beavfree(ptr3);
+        beavfree(ptr4);
+        beavalloc_trace_stop();
+
+        // Calls beavalloc makes to itself are not recorded.
+        memset(&rec, 0, sizeof(rec));
+        assert(beavalloc_trace_read(in, &rec) == 1);
+        assert(rec.op == TRACE_ALLOC && rec.size == 100 && rec.result == (uintptr_t) ptr1);
+        assert(rec.thread == 1);
+        assert(beavalloc_trace_read(in, &rec) == 1);
+        assert(rec.op == TRACE_CALLOC && rec.arg == 10 && rec.size == 30);
+        assert(rec.result == (uintptr_t) ptr2);
+        assert(beavalloc_trace_read(in, &rec) == 1);
+        assert(rec.op == TRACE_REALLOC && rec.ptr == (uintptr_t) ptr2 && rec.size == 1000);
+        assert(rec.result == (uintptr_t) ptr3);
+        assert(beavalloc_trace_read(in, &rec) == 1);
+        assert(rec.op == TRACE_ALIGNED && rec.arg == 64 && rec.size == 200);
+        assert(rec.result == (uintptr_t) ptr4);
+        assert(beavalloc_trace_read(in, &rec) == 1);
+        assert(rec.op == TRACE_FREE && rec.ptr == (uintptr_t) ptr1);
+        assert(beavalloc_trace_read(in, &rec) == 1);
+        assert(rec.op == TRACE_FREE && rec.ptr == (uintptr_t) ptr3);
+        assert(beavalloc_trace_read(in, &rec) == 1);
+        assert(rec.op == TRACE_FREE && rec.ptr == (uintptr_t) ptr4);
+        assert(beavalloc_trace_read(in, &rec) == 0);
+        assert(rec.count == 7);
+        fprintf(stderr, "  %lu records over %lu ns\n", (unsigned long) rec.count, (unsigned long) rec.time);
+
+        // Once stopped nothing more is recorded.
+        beavfree(beavalloc(10));
+        assert(beavalloc_trace_read(in, &rec) == 0);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fclose(in);
+        unlink(path);
+        fprintf(stderr, "*** End %d\n", 34);
+    }
+
+    if (test_number == 0 || test_number == 35) {
+        struct beavalloc_stats stats;
+        pthread_t threads[NUM_THREADS];
+        size_t mapped = 0;
+        long i = 0;
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 35);
+        fprintf(stderr, "      stats\n");
+
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 0 && stats.used_blocks == 0);
+        assert(stats.mapped == 0 && stats.sbrk_calls == 0);
+
+        ptr1 = beavalloc(100);
+        ptr2 = beavalloc(200);
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 112 + 208 && stats.used_blocks == 2);
+        assert(stats.mapped == (size_t) ((char *) sbrk(0) - base));
+            assert(stats.sbrk_calls == 1 && stats.splits == 2);
+        assert(stats.free_blocks == 1);
+        assert(stats.free == stats.mapped - 112 - 208 - 4 * sizeof(struct block));
+
+        // Freeing ptr2 joins it to the free space after it.
+        beavfree(ptr2);
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 112 && stats.used_blocks == 1);
+        assert(stats.coalesces == 1 && stats.free_blocks == 1);
+
+        // Mapped blocks count as mapped and in use until they are freed.
+        mapped = stats.mapped;
+        ptr3 = beavalloc(1024 * 1024);
+        beavalloc_stats(&stats);
+        assert(stats.mmap_calls == 1 && stats.mapped > mapped + 1024 * 1024);
+        assert(stats.in_use > 112 + 1024 * 1024 && stats.used_blocks == 2);
+        beavfree(ptr3);
+        beavfree(ptr1);
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 0 && stats.used_blocks == 0);
+        assert(stats.mapped == mapped && stats.peak_mapped > mapped + 1024 * 1024);
+        beavalloc_dump(FALSE);
+
+        // Counts left by threads that have exited are kept.
+        beavalloc_set_thread_cache(TRUE);
+        beavalloc_set_slabs(TRUE);
+        pthread_barrier_init(&churn_barrier, NULL, NUM_THREADS + 1);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_create(&threads[i], NULL, thread_churn, (void *) i);
+        }
+        pthread_barrier_wait(&churn_barrier);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_barrier_destroy(&churn_barrier);
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 0 && stats.used_blocks == 0 && stats.cached == 0);
+        ptr1 = beavalloc(100);
+        beavfree(ptr1);
+        ptr1 = beavalloc(500);
+        beavfree(ptr1);
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 0 && stats.cached > 0);
+        beavalloc_set_thread_cache(FALSE);
+        beavalloc_set_slabs(FALSE);
+        fprintf(stderr, "  in use %zu cached %zu free %zu mapped %zu peak %zu\n"
+                , stats.in_use, stats.cached, stats.free, stats.mapped, stats.peak_mapped);
+
+        beavalloc_reset();
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 0 && stats.mapped == 0 && stats.peak_mapped == 0);
+        fprintf(stderr, "*** End %d\n", 35);
+    }
+
+    if (test_number == 0 || test_number == 36) {
+        char folded[] = "/tmp/beavprofXXXXXX";
+        char pprof[] = "/tmp/beavprofXXXXXX";
+        char buf[8192];
+        char *ptrs[NUM_PTRS];
+        char *line = NULL;
+        ssize_t len = 0;
+        uint lines = 0;
+        int fd = -1;
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 36);
+        fprintf(stderr, "      heap profile\n");
+
+        // Starting the profiler loads the unwinder, whose own allocations
+        //   can move the break.
+        assert(beavalloc_prof_start(1) == 0);
+        close(mkstemp(folded));
+        close(mkstemp(pprof));
+        base = sbrk(0);
+
+        // At one byte a sample every block is sampled, and a sampled
+        //   block keeps its header even where a slab would have served it.
+        beavalloc_set_slabs(TRUE);
+        for (i = 0; i < NUM_PTRS; i++) {
+            ptrs[i] = (i % 2) ? prof_site_a(100) : prof_site_b(1000);
+        }
+        assert(beavalloc_usable_size(ptrs[1]) == 112);
+        assert(((struct block *) ptrs[1] - 1)->flags & BLOCK_SAMPLED);
+        beavalloc_prof_stop();
+        beavfree(beavalloc(100));
+
+        assert(beavalloc_prof_dump(folded, PROF_FOLDED) == 0);
+        fd = open(folded, O_RDONLY);
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        assert(len > 0);
+        buf[len] = '\0';
+        for (line = strtok(buf, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+            unsigned long bytes = strtoul(strrchr(line, ' ') + 1, NULL, 10);
+
+            assert(bytes == 50 * 100 || bytes == 50 * 1000);
+            lines++;
+        }
+        assert(lines == 2);
+
+        assert(beavalloc_prof_dump(pprof, PROF_PPROF) == 0);
+        fd = open(pprof, O_RDONLY);
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        assert(len > 0);
+        buf[len] = '\0';
+        assert(strncmp(buf, "heap profile: 100: 55000 [100: 55000] @ heap_v2/1\n", 50) == 0);
+        assert(strstr(buf, "\n50: 5000 [50: 5000] @ 0x") != NULL);
+        assert(strstr(buf, "\n50: 50000 [50: 50000] @ 0x") != NULL);
+        fprintf(stderr, "%.*s", (int) (strchr(buf, '\n') - buf + 1), buf);
+
+        // Freed blocks leave the live counts but not the totals.
+        for (i = 0; i < NUM_PTRS; i++) {
+            beavfree(ptrs[i]);
+        }
+        assert(beavalloc_prof_dump(pprof, PROF_PPROF) == 0);
+        fd = open(pprof, O_RDONLY);
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        assert(len > 0);
+        buf[len] = '\0';
+        assert(strncmp(buf, "heap profile: 0: 0 [100: 55000] @ heap_v2/1\n", 44) == 0);
+        beavalloc_set_slabs(FALSE);
+
+        unlink(folded);
+        unlink(pprof);
+        beavalloc_reset();
+        line = sbrk(0);
+        assert(line == base);
+        fprintf(stderr, "*** End %d\n", 36);
+    }
+
+    if (test_number == 0 || test_number == 37) {
+        char *ptrs[8] = {NULL};
+        char *ptr1 = NULL;
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 37);
+        fprintf(stderr, "      placement %s\n", POLICY_NAME);
+
+        // Free blocks of 3008, 2512, 2064 and 3008 bytes with blocks in
+        //   use between them, all carved in turn from one free block. The
+        //   blocks in use are too big for the slabs and thread caches.
+        base = sbrk(0);
+        beavfree(beavalloc(64 * 1024));
+        for (i = 0; i < 8; i += 2) {
+            ptrs[i] = beavalloc(i == 2 ? 2500 : i == 4 ? 2060 : 3000);
+            ptrs[i + 1] = beavalloc(1100);
+        }
+        for (i = 0; i < 8; i += 2) {
+            beavfree(ptrs[i]);
+        }
+
+        // A request of 2100 fits the 2512 block best, though the 2064 block
+        //   shares its size class. The bins take the last block freed to
+        //   the next class up, first and next fit the lowest block.
+        ptr1 = beavalloc(2100);
+        if (POLICY == POLICY_BEST_FIT) {
+            assert(ptr1 == ptrs[2]);
+        }
+        else if (POLICY == POLICY_BINS) {
+            assert(ptr1 == ptrs[6]);
+        }
+        else {
+            assert(ptr1 == ptrs[0]);
+        }
+        beavfree(ptr1);
+
+        // Of two blocks as good as each other the lower is taken.
+        ptr1 = beavalloc(2900);
+        if (POLICY == POLICY_BEST_FIT || POLICY == POLICY_FIRST_FIT) {
+            assert(ptr1 == ptrs[0]);
+        }
+        beavfree(ptr1);
+        beavalloc_dump(FALSE);
+
+        for (i = 0; i < 8; i++) {
+            beavfree(ptrs[i]);
+        }
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 37);
+    }
+
+    if (test_number == 0 || test_number == 38) {
+        struct beavalloc_stats stats;
+        char *ptrs[NUM_PTRS] = {NULL};
+        char *ptr1 = NULL;
+        uint64_t calls = 0;
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 38);
+        fprintf(stderr, "      heap growth\n");
+
+        // The first growth is GROW_MIN, and the rest of it is left free
+        //   at the top of the heap.
+        base = sbrk(0);
+        ptrs[0] = beavalloc(1000);
+        beavalloc_stats(&stats);
+        assert((size_t) ((char *) sbrk(0) - base) >= GROW_MIN);
+        assert(stats.sbrk_calls == 1 && stats.free_blocks == 1);
+
+        // Each growth after that doubles, so a few hundred blocks too big
+        //   for the slabs take a handful of calls.
+        for (i = 1; i < NUM_PTRS; i++) {
+            ptrs[i] = beavalloc(1000);
+        }
+        beavalloc_stats(&stats);
+        calls = stats.sbrk_calls;
+        assert(calls < 12);
+        for (i = 0; i < NUM_PTRS; i++) {
+            beavfree(ptrs[i]);
+        }
+        beavalloc_reset();
+        assert(sbrk(0) == base);
+
+        // Growing by just what each request needs takes a call for each.
+        beavalloc_set_growth(MIN_MEM, MIN_MEM);
+        for (i = 0; i < NUM_PTRS; i++) {
+            ptrs[i] = beavalloc(1000);
+        }
+        beavalloc_stats(&stats);
+        assert(stats.sbrk_calls >= NUM_PTRS / 2 && stats.sbrk_calls > 10 * calls);
+        beavalloc_dump(FALSE);
+        for (i = 0; i < NUM_PTRS; i++) {
+            beavfree(ptrs[i]);
+        }
+        beavalloc_set_growth(GROW_MIN, GROW_MAX);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 38);
+    }
+
+    if (test_number == 0 || test_number == 39) {
+        struct beavalloc_region *region = NULL;
+        struct beavalloc_stats stats;
+        char *ptrs[NUM_PTRS] = {NULL};
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        int64_t in_use = 0;
+        int i = 0;
+        size_t j = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 39);
+        fprintf(stderr, "      regions\n");
+
+        base = sbrk(0);
+        region = beavalloc_region_create();
+        assert(region != NULL);
+        assert(beavalloc_region_alloc(region, 0) == NULL);
+
+        // Objects follow one another with nothing between them.
+        ptr1 = beavalloc_region_alloc(region, 10);
+        ptr2 = beavalloc_region_alloc(region, 20);
+        assert(ptr2 == ptr1 + 16);
+        assert(((uintptr_t) ptr2 & (ALIGNMENT - 1)) == 0);
+
+        // Enough objects to take several chunks, and one bigger than any
+        //   chunk.
+        for (i = 0; i < NUM_PTRS; i++) {
+            ptrs[i] = beavalloc_region_alloc(region, 100 + i * 10);
+            assert(ptrs[i] != NULL);
+            memset(ptrs[i], i, 100 + i * 10);
+        }
+        ptr2 = beavalloc_region_alloc(region, REGION_CHUNK_MAX * 2);
+        assert(ptr2 != NULL);
+        memset(ptr2, 0xff, REGION_CHUNK_MAX * 2);
+        for (i = 0; i < NUM_PTRS; i++) {
+            for (j = 0; j < 100 + i * 10; j++) {
+                assert(ptrs[i][j] == (char) i);
+            }
+        }
+        beavalloc_stats(&stats);
+        in_use = stats.in_use;
+
+        // A reset starts again from the top of the first chunk, and the
+        //   same objects again fit in the chunks the region already has.
+        beavalloc_region_reset(region);
+        assert(beavalloc_region_alloc(region, 10) == ptr1);
+        for (i = 0; i < NUM_PTRS; i++) {
+            ptrs[i] = beavalloc_region_alloc(region, 100 + i * 10);
+            memset(ptrs[i], i, 100 + i * 10);
+        }
+        assert(beavalloc_region_alloc(region, REGION_CHUNK_MAX * 2) != NULL);
+        beavalloc_stats(&stats);
+        assert(stats.in_use == in_use);
+
+        // Destroying the region gives every chunk back.
+        beavalloc_region_destroy(region);
+        beavalloc_stats(&stats);
+        assert(stats.used_blocks == 0);
+        beavalloc_dump(FALSE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 39);
+    }
+
+    if (test_number == 0 || test_number == 40) {
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        size_t sizes[] = {100, 40000, 60000, 1024 * 1024};
+        size_t i = 0;
+        size_t j = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 40);
+        fprintf(stderr, "      beavcalloc zeroed memory\n");
+
+        base = sbrk(0);
+        errno = 0;
+        assert(beavcalloc(SIZE_MAX / 2, 3) == NULL && errno == ENOMEM);
+
+        // From the slabs, fresh core and a mapping, then again after each
+        //   block has been written and freed.
+        for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            ptr1 = beavcalloc(sizes[i], 1);
+            assert(ptr1 != NULL);
+            for (j = 0; j < sizes[i]; j++) {
+                assert(ptr1[j] == 0);
+            }
+            memset(ptr1, 0xff, sizes[i]);
+            beavfree(ptr1);
+            ptr1 = beavcalloc(1, sizes[i]);
+            for (j = 0; j < sizes[i]; j++) {
+                assert(ptr1[j] == 0);
+            }
+            memset(ptr1, 0xff, sizes[i]);
+            beavfree(ptr1);
+        }
+        beavalloc_reset();
+
+        // A free block away from the top is purged, and only its links,
+        //   footer and partial pages need clearing when it is reused.
+        beavalloc_set_trim_threshold(TRIM_THRESHOLD / 4);
+        ptr1 = beavalloc(60000);
+        ptr2 = beavalloc(2000);
+        memset(ptr1, 0xff, 60000);
+        beavfree(ptr1);
+        ptr3 = beavcalloc(60000, 1);
+        assert(ptr3 == ptr1);
+        for (j = 0; j < 60000; j++) {
+            assert(ptr3[j] == 0);
+        }
+        beavfree(ptr3);
+        beavfree(ptr2);
+        beavalloc_set_trim_threshold(TRIM_THRESHOLD);
+        beavalloc_dump(FALSE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 40);
+    }
+
+    if (test_number == 0 || test_number == 41) {
+        struct beavalloc_stats before;
+        struct beavalloc_stats stats;
+        char *ptrs[2 * REMOTE_BATCH + 1] = {NULL};
+        char *batch[REMOTE_BATCH + 1] = {NULL};
+        pthread_t thread;
+        char *ptr1 = NULL;
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 41);
+        fprintf(stderr, "      remote frees\n");
+
+        // Blocks too big for the thread caches, from the default arena.
+        base = sbrk(0);
+        for (i = 0; i < 2 * REMOTE_BATCH; i++) {
+            ptrs[i] = beavalloc(2000);
+        }
+        beavalloc_stats(&before);
+
+        // Freed by a thread that does not own the arena, they wait on its
+        //   remote list, counted as freed but not yet in the bins.
+        memcpy(batch, ptrs, 8 * sizeof(char *));
+        pthread_create(&thread, NULL, thread_free_all, batch);
+        pthread_join(thread, NULL);
+        beavalloc_stats(&stats);
+        assert(stats.used_blocks == before.used_blocks - 8);
+        assert(stats.free == before.free && stats.free_blocks == before.free_blocks);
+        beavfree(ptrs[0]);
+        beavalloc_stats(&stats);
+        assert(stats.used_blocks == before.used_blocks - 8);
+
+        // The owner takes them in as it next allocates.
+        ptr1 = beavalloc(2000);
+        beavalloc_stats(&stats);
+        assert(stats.free > before.free);
+        before = stats;
+
+        // A full batch is drained by the thread that pushes it.
+        memcpy(batch, ptrs + 8, REMOTE_BATCH * sizeof(char *));
+        pthread_create(&thread, NULL, thread_free_all, batch);
+        pthread_join(thread, NULL);
+        beavalloc_stats(&stats);
+        assert(stats.used_blocks == before.used_blocks - REMOTE_BATCH);
+        assert(stats.free > before.free);
+        beavalloc_dump(FALSE);
+
+        beavfree(ptr1);
+        for (i = 8 + REMOTE_BATCH; i < 2 * REMOTE_BATCH; i++) {
+            beavfree(ptrs[i]);
+        }
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 41);
+    }
+
+    if (test_number == 0 || test_number == 42) {
+        struct beavalloc_stats stats;
+        char *ptrs[CPU_CACHE_COUNT + 8] = {NULL};
+        char *again[CPU_CACHE_COUNT + 8] = {NULL};
+        char *batch[2] = {NULL};
+        cpu_set_t cpus;
+        cpu_set_t one;
+        pthread_t thread;
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 42);
+        fprintf(stderr, "      per-CPU caches\n");
+
+        // Kept to one CPU, so everything freed goes to the same cache.
+        base = sbrk(0);
+        sched_getaffinity(0, sizeof(cpus), &cpus);
+        CPU_ZERO(&one);
+        CPU_SET(sched_getcpu(), &one);
+        sched_setaffinity(0, sizeof(one), &one);
+
+        if (!beavalloc_set_cpu_cache(TRUE)) {
+            fprintf(stderr, "      no rseq, the thread caches stand in\n");
+            ptr1 = beavalloc(500);
+            beavfree(ptr1);
+            ptr2 = beavalloc(500);
+            assert(ptr2 == ptr1);
+            beavfree(ptr2);
+        }
+        else {
+            // A heap block comes straight back, and freeing it twice does
+            //   not hand it out twice.
+            ptr1 = beavalloc(100);
+            beavfree(ptr1);
+            beavalloc_stats(&stats);
+            assert(stats.cached == 112 && stats.used_blocks == 0);
+            ptr2 = beavalloc(100);
+            assert(ptr2 == ptr1);
+            beavfree(ptr2);
+            beavfree(ptr2);
+            ptr2 = beavalloc(100);
+            ptr3 = beavalloc(100);
+            assert(ptr2 == ptr1 && ptr3 != ptr1);
+            beavfree(ptr3);
+            beavfree(ptr2);
+
+            // So does a slab object.
+            beavalloc_set_slabs(TRUE);
+            ptr1 = beavalloc(80);
+            beavfree(ptr1);
+            beavfree(ptr1);
+            ptr2 = beavalloc(80);
+            ptr3 = beavalloc(80);
+            assert(ptr2 == ptr1 && ptr3 != ptr1);
+            beavfree(ptr3);
+            beavfree(ptr2);
+
+            // What another thread on the CPU frees is reused by this one.
+            batch[0] = beavalloc(200);
+            pthread_create(&thread, NULL, thread_free_all, batch);
+            pthread_join(thread, NULL);
+            ptr1 = beavalloc(200);
+            assert(ptr1 == batch[0]);
+            beavfree(ptr1);
+
+            // A full class leaves the rest to the slabs.
+            for (i = 0; i < CPU_CACHE_COUNT + 8; i++) {
+                ptrs[i] = beavalloc(48);
+            }
+            for (i = 0; i < CPU_CACHE_COUNT + 8; i++) {
+                beavfree(ptrs[i]);
+            }
+            beavalloc_dump(TRUE);
+            for (i = 0; i < CPU_CACHE_COUNT + 8; i++) {
+                again[i] = beavalloc(48);
+                if (i < CPU_CACHE_COUNT) {
+                    assert(again[i] == ptrs[CPU_CACHE_COUNT - 1 - i]);
+                }
+            }
+            for (i = 0; i < CPU_CACHE_COUNT + 8; i++) {
+                beavfree(again[i]);
+            }
+            beavalloc_set_slabs(FALSE);
+        }
+        assert(beavalloc_set_cpu_cache(FALSE) == FALSE);
+        beavalloc_dump(FALSE);
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 42);
+    }
+
+    if (test_number == 0 || test_number == 43) {
+        struct beavalloc_stats before;
+        struct beavalloc_stats stats;
+        char *ptrs[FAST_LIMIT / 496 + 8] = {NULL};
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *ptr4 = NULL;
+        int n = sizeof(ptrs) / sizeof(ptrs[0]);
+        int i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 43);
+        fprintf(stderr, "      fast bins\n");
+
+        base = sbrk(0);
+        beavalloc_set_fast_bins(TRUE);
+
+        // Freed next to the free top of the heap, a small block is left
+        //   whole on its fast bin and comes straight back.
+        ptr1 = beavalloc(200);
+        ptr2 = beavalloc(300);
+        beavalloc_stats(&before);
+        beavfree(ptr2);
+        beavalloc_stats(&stats);
+        assert(stats.coalesces == before.coalesces);
+        assert(stats.free_blocks == before.free_blocks + 1);
+        ptr3 = beavalloc(300);
+        beavalloc_stats(&stats);
+        assert(ptr3 == ptr2 && stats.splits == before.splits);
+
+        // Freeing it twice does not put it on the bin twice.
+        beavfree(ptr3);
+        beavfree(ptr3);
+        ptr3 = beavalloc(300);
+        ptr4 = beavalloc(300);
+        assert(ptr3 == ptr2 && ptr4 != ptr2);
+        beavfree(ptr4);
+        beavfree(ptr3);
+        beavfree(ptr1);
+        beavalloc_dump(FALSE);
+
+        // A trim consolidates them first.
+        beavalloc_trim(0);
+        beavalloc_stats(&stats);
+        assert(stats.free_blocks == 1);
+        beavalloc_reset();
+
+        // So does a larger request that finds no free block. The first
+        //   core holds seven of these and a little more.
+        for (i = 0; i < 7; i++) {
+            ptrs[i] = beavalloc(496);
+        }
+        ptr1 = sbrk(0);
+        for (i = 0; i < 7; i++) {
+            beavfree(ptrs[i]);
+        }
+        ptr2 = beavalloc(2000);
+        assert(ptr2 == ptrs[0] && sbrk(0) == ptr1);
+        beavfree(ptr2);
+        beavalloc_reset();
+
+        // And having more than FAST_LIMIT bytes on the bins.
+        for (i = 0; i < n; i++) {
+            ptrs[i] = beavalloc(496);
+        }
+        beavalloc_stats(&before);
+        for (i = 0; i < n; i++) {
+            beavfree(ptrs[i]);
+        }
+        beavalloc_stats(&stats);
+        assert(stats.coalesces > before.coalesces);
+        assert(stats.free_blocks < before.free_blocks + n);
+
+        beavalloc_set_fast_bins(FALSE);
+        beavalloc_stats(&stats);
+        assert(stats.free_blocks == 1);
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 43);
+    }
+
+    if (test_number == 0 || test_number == 44) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        unsigned char vec[300000 / 4096 + 2];
+        char *ptr1 = NULL;
+        char *ptr2 = NULL;
+        char *ptr3 = NULL;
+        char *top = NULL;
+        char *start = NULL;
+        size_t pages = 0;
+        size_t i = 0;
+
+        fprintf(stderr, "*** Begin %d\n", 44);
+        fprintf(stderr, "      background purge\n");
+
+        // The thread library may move the break to start the thread, so
+        //   the heap starts after it does.
+        assert(beavalloc_set_decay(100) == 0);
+        base = sbrk(0);
+        beavalloc_set_mmap_threshold(0);
+        ptr1 = beavalloc(300000);
+        ptr2 = beavalloc(100);
+        ptr3 = beavalloc(300000);
+        memset(ptr1, 0xff, 300000);
+        memset(ptr3, 0xff, 300000);
+        top = sbrk(0);
+
+        // Big enough to be trimmed as they are freed, they are left to the
+        //   purge thread instead.
+        beavfree(ptr3);
+        beavfree(ptr1);
+        assert(sbrk(0) == top);
+
+        // Well past the decay time the top of the heap is given back and
+        //   the pages inside the other block are gone.
+        usleep(500000);
+        assert((char *)sbrk(0) < top);
+        start = (char *)(((uintptr_t)ptr1 + 2 * page - 1) & ~(page - 1));
+        pages = (300000 - 2 * page) / page;
+        assert(mincore(start, pages * page, vec) == 0);
+        for (i = 0; i < pages; i++) {
+            assert((vec[i] & 1) == 0);
+        }
+        assert(beavalloc_set_decay(0) == 0);
+        beavalloc_dump(FALSE);
+
+        beavfree(ptr2);
+        beavalloc_set_mmap_threshold(MMAP_THRESHOLD);
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 44);
+    }
+
+    if (test_number == 0 || test_number == 45) {
+        char path[] = "/tmp/beavtraceXXXXXX";
+        struct beavalloc_trace_rec rec;
+        pthread_t threads[NUM_THREADS];
+        uint64_t live[NUM_THREADS * NUM_PTRS];
+        uint num_live = 0;
+        uint unknown = 0;
+        uint j = 0;
+        FILE *in = NULL;
+        long i = 0;
+        char *ptr1 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 45);
+        fprintf(stderr, "      trace from threads\n");
+
+        // Threads share the slab classes, so an object one of them frees
+        //   or moves with a realloc is soon handed to another. Played back
+        //   in order, every free and realloc must find its block still live.
+        close(mkstemp(path));
+        in = fopen(path, "r");
+        assert(in != NULL);
+        beavalloc_set_slabs(TRUE);
+        pthread_barrier_init(&churn_barrier, NULL, NUM_THREADS + 1);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_create(&threads[i], NULL
+                           , i % 2 ? thread_realloc_churn : thread_churn, (void *) i);
+        }
+        base = sbrk(0);
+        assert(beavalloc_trace_start(path) == 0);
+        pthread_barrier_wait(&churn_barrier);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_barrier_destroy(&churn_barrier);
+        beavalloc_trace_stop();
+        beavalloc_set_slabs(FALSE);
+
+        memset(&rec, 0, sizeof(rec));
+        while (beavalloc_trace_read(in, &rec) == 1) {
+            if (rec.op == TRACE_FREE && rec.ptr == 0) {
+                continue;
+            }
+            if (rec.op == TRACE_FREE || rec.op == TRACE_REALLOC) {
+                for (j = 0; j < num_live && live[j] != rec.ptr; j++) {
+                    continue;
+                }
+                if (j == num_live) {
+                    unknown++;
+                    continue;
+                }
+                if (rec.op == TRACE_REALLOC) {
+                    live[j] = rec.result;
+                    continue;
+                }
+                live[j] = live[--num_live];
+            }
+            else {
+                assert(rec.op == TRACE_ALLOC && num_live < NUM_THREADS * NUM_PTRS);
+                live[num_live++] = rec.result;
+            }
+        }
+        fprintf(stderr, "  %lu records, %u unknown\n", (unsigned long) rec.count, unknown);
+        assert(unknown == 0 && num_live == 0);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fclose(in);
+        unlink(path);
+        fprintf(stderr, "*** End %d\n", 45);
+    }
+
+    if (test_number == 0 || test_number == 46) {
+        struct beavalloc_stats stats;
+        pthread_t threads[NUM_THREADS];
+        long i = 0;
+        char *ptr1 = NULL;
+
+        fprintf(stderr, "*** Begin %d\n", 46);
+        fprintf(stderr, "      threads exiting with full caches\n");
+
+        // The threads make exit_key once they have used the cache, so
+        //   beavalloc's own thread exit destructors come before it, and it
+        //   allocates and frees after them in every round.
+        beavalloc_set_thread_cache(TRUE);
+        pthread_barrier_init(&churn_barrier, NULL, NUM_THREADS + 1);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_create(&threads[i], NULL, thread_exit_cached, NULL);
+        }
+        base = sbrk(0);
+        pthread_barrier_wait(&churn_barrier);
+        for (i = 0; i < NUM_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_barrier_destroy(&churn_barrier);
+        pthread_key_delete(exit_key);
+        beavalloc_set_thread_cache(FALSE);
+
+        // What the threads freed as they went is back in the heap, not
+        //   stranded in caches nothing will flush again.
+        beavalloc_stats(&stats);
+        assert(stats.in_use == 0 && stats.used_blocks == 0 && stats.cached == 0);
+        beavalloc_dump(TRUE);
+
+        beavalloc_reset();
+        ptr1 = sbrk(0);
+        assert(ptr1 == base);
+        fprintf(stderr, "*** End %d\n", 46);
+    }
+
+    if (test_number == 0) {
+        fprintf(stderr, "\n\nWoooooooHooooooo!!! All tests done and you survived.\n\n\t %c[5m Make sure they are correct. %c[0m \n\n\n", 27, 27);
+    }
+    else {
+        fprintf(stderr, "\n\nWoooooooHooooooo!!! You survived test %d.\n\n\t %c[5m Make sure it is correct. %c[0m \n\n\n", test_number, 27, 27);
+    }
+}
+
+// Allocate, fill, check and free blocks of mixed sizes from one thread,
+//   freeing some of them on a later round than they were made.
+void *
+thread_churn(void *arg)
+{
+    const ushort num_ptrs = NUM_PTRS;
+    char *ptrs[num_ptrs];
+    size_t sizes[num_ptrs];
+    char fill = (char) (long) arg + 1;
+    uint seed = (uint) (long) arg;
+    int round = 0;
+    int i = 0;
+
+    memset(ptrs, 0, sizeof(ptrs));
+    pthread_barrier_wait(&churn_barrier);
+    for (round = 0; round < 200; round++) {
+        for (i = 0; i < num_ptrs; i++) {
+            if (ptrs[i] != NULL && (rand_r(&seed) % 2)) {
+                size_t j = 0;
+
+                for (j = 0; j < sizes[i]; j++) {
+                    assert(ptrs[i][j] == fill);
+                }
+                beavfree(ptrs[i]);
+                ptrs[i] = NULL;
+            }
+            if (ptrs[i] == NULL) {
+                sizes[i] = 1 + rand_r(&seed) % (i % 4 ? 256 : 4000);
+                ptrs[i] = beavalloc(sizes[i]);
+                assert(ptrs[i] != NULL);
+                memset(ptrs[i], fill, sizes[i]);
+            }
+        }
+    }
+    for (i = 0; i < num_ptrs; i++) {
+        beavfree(ptrs[i]);
+    }
+    return NULL;
+}
+
+// Grow blocks with beavrealloc until they move from one slab class to
+//   the next, or off the slabs, checking they keep what they held.
+void *
+thread_realloc_churn(void *arg)
+{
+    const ushort num_ptrs = NUM_PTRS;
+    char *ptrs[num_ptrs];
+    size_t sizes[num_ptrs];
+    char fill = (char) (long) arg + 1;
+    uint seed = (uint) (long) arg;
+    int round = 0;
+    int i = 0;
+
+    memset(ptrs, 0, sizeof(ptrs));
+    pthread_barrier_wait(&churn_barrier);
+    for (round = 0; round < 200; round++) {
+        for (i = 0; i < num_ptrs; i++) {
+            if (ptrs[i] == NULL) {
+                sizes[i] = 1 + rand_r(&seed) % 64;
+                ptrs[i] = beavalloc(sizes[i]);
+                assert(ptrs[i] != NULL);
+                memset(ptrs[i], fill, sizes[i]);
+            }
+            else if (sizes[i] < 1024 && (rand_r(&seed) % 2)) {
+                size_t j = 0;
+
+                ptrs[i] = beavrealloc(ptrs[i], sizes[i] * 2);
+                assert(ptrs[i] != NULL);
+                for (j = 0; j < sizes[i]; j++) {
+                    assert(ptrs[i][j] == fill);
+                }
+                sizes[i] *= 2;
+                memset(ptrs[i], fill, sizes[i]);
+            }
+            else {
+                beavfree(ptrs[i]);
+                ptrs[i] = NULL;
+            }
+        }
+    }
+    for (i = 0; i < num_ptrs; i++) {
+        beavfree(ptrs[i]);
+    }
+    return NULL;
+}
+
+// Free every block of the NULL terminated list from a thread that has
+//   not allocated anything.
+void *
+thread_free_all(void *arg)
+{
+    char **ptrs = arg;
+
+    for (; *ptrs != NULL; ptrs++) {
+        beavfree(*ptrs);
+    }
+    return NULL;
+}
+
+// Exit with blocks of several sizes left in the thread cache, and have
+//   exit_churn() allocate again as the thread goes.
+void *
+thread_exit_cached(void *arg)
+{
+    int i = 0;
+
+    (void) arg;
+    pthread_barrier_wait(&churn_barrier);
+    for (i = 1; i <= 20; i++) {
+        beavfree(beavalloc(i * 24));
+    }
+    pthread_once(&exit_once, exit_key_create);
+    pthread_setspecific(exit_key, (void *) 1);
+    return NULL;
+}
+
+void
+exit_key_create(void)
+{
+    pthread_key_create(&exit_key, exit_churn);
+}
+
+// A destructor that runs after beavalloc's own, through every round of
+//   destructors there is.
+void
+exit_churn(void *arg)
+{
+    uintptr_t round = (uintptr_t) arg;
+
+    beavfree(beavalloc(100 + round * 16));
+    if (round < PTHREAD_DESTRUCTOR_ITERATIONS) {
+        pthread_setspecific(exit_key, (void *) (round + 1));
+    }
+}
+
+void *
+prof_site_a(size_t size)
+{
+    return beavalloc(size);
+}
+
+void *
+prof_site_b(size_t size)
+{
+    return beavalloc(size);
 }
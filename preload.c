@@ -0,0 +1,174 @@
+/*
+ * @brief malloc() and friends on top of beavalloc, to be loaded into
+ *   unmodified programs with LD_PRELOAD=./libbeavalloc.so.
+ */
+
+#include <malloc.h>
+
+#include "beavalloc.h"
+
+static void preload_init(void) __attribute__((constructor));
+static void preload_fini(void) __attribute__((destructor));
+static const char *preload_path(const char *name, char *path, size_t len);
+
+static char prof_path[4096];
+static int prof_format = PROF_PPROF;
+
+// Runs as the library is loaded, before main(). pthread_atfork() may
+//   allocate, which by now already works. BEAVALLOC_TRACE names a file to
+//   record the program's allocations to. BEAVALLOC_PROF names a file for
+//   a heap profile, written as folded stacks if it ends in .folded, when
+//   the program exits or on BEAVALLOC_PROF_SIGNAL; BEAVALLOC_PROF_RATE
+//   sets the mean bytes between samples. BEAVALLOC_CPU_CACHE=1 turns the
+//   per-CPU caches on. BEAVALLOC_DECAY_MS starts the background purge
+//   thread with that decay time.
+static void
+preload_init(void)
+{
+    static char path[4096];
+    const char *trace = getenv("BEAVALLOC_TRACE");
+    const char *prof = getenv("BEAVALLOC_PROF");
+    const char *rate = getenv("BEAVALLOC_PROF_RATE");
+    const char *signo = getenv("BEAVALLOC_PROF_SIGNAL");
+    const char *cpu = getenv("BEAVALLOC_CPU_CACHE");
+    const char *decay = getenv("BEAVALLOC_DECAY_MS");
+    size_t len = 0;
+
+    pthread_atfork(beavalloc_atfork_prepare, beavalloc_atfork_parent, beavalloc_atfork_child);
+    if (cpu != NULL && atoi(cpu)) {
+        beavalloc_set_cpu_cache(TRUE);
+    }
+    if (decay != NULL && *decay != '\0') {
+        beavalloc_set_decay(strtoul(decay, NULL, 0));
+    }
+    if (trace != NULL && *trace != '\0') {
+        beavalloc_trace_start(preload_path(trace, path, sizeof(path)));
+    }
+    if (prof != NULL && *prof != '\0') {
+        preload_path(prof, prof_path, sizeof(prof_path));
+        len = strlen(prof_path);
+        if (len > 7 && strcmp(prof_path + len - 7, ".folded") == 0) {
+            prof_format = PROF_FOLDED;
+        }
+        if (signo != NULL && *signo != '\0') {
+            beavalloc_prof_signal(atoi(signo), prof_path, prof_format);
+        }
+        beavalloc_prof_start(rate ? strtoul(rate, NULL, 0) : 0);
+    }
+}
+
+static void
+preload_fini(void)
+{
+    beavalloc_trace_stop();
+    if (prof_path[0] != '\0') {
+        beavalloc_prof_dump(prof_path, prof_format);
+    }
+}
+
+// Every program the first one runs inherits the environment, so a %p in
+//   a file name is replaced by the process id to keep them from writing
+//   over each other.
+static const char *
+preload_path(const char *name, char *path, size_t len)
+{
+    const char *pid = strstr(name, "%p");
+
+    if (pid == NULL) {
+        snprintf(path, len, "%s", name);
+    }
+    else {
+        snprintf(path, len, "%.*s%d%s", (int) (pid - name), name, (int) getpid(), pid + 2);
+    }
+    return path;
+}
+
+// beavalloc() turns 0 down, but malloc(0) has to return something that
+//   can be passed to free(), so zero sized requests get the smallest block.
+void *
+malloc(size_t size)
+{
+    return beavalloc(size ? size : 1);
+}
+
+void
+free(void *ptr)
+{
+    beavfree(ptr);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    if (nmemb == 0 || size == 0) {
+        return beavcalloc(1, 1);
+    }
+    return beavcalloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        beavfree(ptr);
+        return NULL;
+    }
+    return beavrealloc(ptr, size);
+}
+
+void *
+reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+    size_t total = 0;
+
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, total);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    return beavposix_memalign(memptr, alignment, size ? size : 1);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size)
+{
+    return beavaligned_alloc(alignment, size ? size : 1);
+}
+
+void *
+memalign(size_t alignment, size_t size)
+{
+    return beavmemalign(alignment, size ? size : 1);
+}
+
+void *
+valloc(size_t size)
+{
+    return beavmemalign(sysconf(_SC_PAGESIZE), size ? size : 1);
+}
+
+void *
+pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return beavmemalign(page, size ? (size + page - 1) & ~(page - 1) : page);
+}
+
+size_t
+malloc_usable_size(void *ptr)
+{
+    return beavalloc_usable_size(ptr);
+}
@@ -0,0 +1,353 @@
+/*
+ * @brief Replay an allocation trace recorded by beavalloc_trace_start()
+ *   against beavalloc or the system malloc.
+ */
+
+#include <sys/resource.h>
+
+#include "beavalloc.h"
+
+#define OPTIONS "ha:"
+
+// The trace is read through a buffer of its own, a record at a time, so
+//   a trace of any length replays in the same memory.
+#define READ_BUFFER     (1024 * 1024)
+
+// The allocator a trace is replayed against.
+struct allocator
+{
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*aligned)(size_t alignment, size_t size);
+};
+
+// A block of the trace, by the address it had when it was recorded.
+struct live_block
+{
+    uint64_t id;
+    void *ptr;
+    size_t size;
+};
+
+static int replay(FILE *in, const struct allocator *a);
+static void *system_aligned(size_t alignment, size_t size);
+static size_t live_hash(uint64_t id);
+static struct live_block *live_find(uint64_t id);
+static void live_insert(uint64_t id, void *ptr, size_t size);
+static void live_remove(struct live_block *b);
+static void live_grow(void);
+static void touch(void *ptr, size_t size);
+static size_t rss_bytes(void);
+static uint64_t now_ns(void);
+
+static const struct allocator allocators[] = {
+    {"beavalloc", beavalloc, beavfree, beavcalloc, beavrealloc, beavalloc_aligned},
+    {"malloc", malloc, free, calloc, realloc, system_aligned},
+};
+
+// Live blocks are kept in an open addressed table, mapped straight from
+//   the kernel so it stays out of the heap being measured.
+static struct live_block *table = NULL;
+static size_t table_size = 0;
+static size_t table_used = 0;
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+static int statm_fd = -1;
+static char read_buf[READ_BUFFER];
+
+int
+main(int argc, char **argv)
+{
+    const struct allocator *a = &allocators[0];
+    FILE *in = stdin;
+    int ret = 0;
+    {
+        int opt = -1;
+        uint i = 0;
+
+        while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+            switch (opt) {
+            case 'h':
+                fprintf(stderr, "%s %s [trace]\n", argv[0], OPTIONS);
+                exit(0);
+                break;
+            case 'a':
+                for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++) {
+                    if (strcmp(optarg, allocators[i].name) == 0) {
+                        a = &allocators[i];
+                        break;
+                    }
+                }
+                if (i == sizeof(allocators) / sizeof(allocators[0])) {
+                    fprintf(stderr, "%s: no allocator %s\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default: /* '?' */
+                fprintf(stderr, "%s\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        in = fopen(argv[optind], "r");
+        if (in == NULL) {
+            perror(argv[optind]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // The read buffer is made resident now so it is not taken for heap.
+    memset(read_buf, 0, sizeof(read_buf));
+    setvbuf(in, read_buf, _IOFBF, sizeof(read_buf));
+    statm_fd = open("/proc/self/statm", O_RDONLY);
+
+    ret = replay(in, a);
+    if (in != stdin) {
+        fclose(in);
+    }
+    return ret;
+}
+
+// Make each call of the trace in the order recorded, from this one
+//   thread, so a replay goes the same way every time. Frees of blocks the
+//   trace never saw allocated are counted and skipped.
+static int
+replay(FILE *in, const struct allocator *a)
+{
+    struct beavalloc_trace_rec rec;
+    struct rusage usage;
+    size_t base = rss_bytes();
+    size_t peak_rss = 0;
+    uint64_t alloc_ns = 0;
+    uint64_t start = now_ns();
+    uint64_t unknown = 0;
+    uint threads = 0;
+    int ret = 0;
+
+    memset(&rec, 0, sizeof(rec));
+    live_grow();
+    while ((ret = beavalloc_trace_read(in, &rec)) > 0) {
+        struct live_block *b = NULL;
+        void *old = NULL;
+        size_t old_size = 0;
+        void *ptr = NULL;
+        uint64_t t0 = 0;
+
+        threads = MAX(threads, rec.thread);
+        if (rec.ptr != 0) {
+            b = live_find(rec.ptr);
+            if (b == NULL) {
+                unknown++;
+                if (rec.op == TRACE_FREE) {
+                    continue;
+                }
+            }
+            else {
+                old = b->ptr;
+                old_size = b->size;
+                live_remove(b);
+            }
+        }
+
+        t0 = now_ns();
+        switch (rec.op) {
+        case TRACE_ALLOC:
+            ptr = a->alloc(rec.size);
+            break;
+        case TRACE_FREE:
+            a->free(old);
+            break;
+        case TRACE_CALLOC:
+            ptr = a->calloc(rec.arg, rec.size);
+            rec.size *= rec.arg;
+            break;
+        case TRACE_REALLOC:
+            ptr = a->realloc(old, rec.size);
+            break;
+        case TRACE_ALIGNED:
+            ptr = a->aligned(rec.arg, rec.size);
+            break;
+        }
+        alloc_ns += now_ns() - t0;
+
+        live_bytes -= old_size;
+        if (rec.result != 0 && ptr != NULL) {
+            touch(ptr, rec.size);
+            live_insert(rec.result, ptr, rec.size);
+            live_bytes += rec.size;
+            peak_bytes = MAX(peak_bytes, live_bytes);
+        }
+        else if (rec.op == TRACE_REALLOC && rec.size != 0 && old != NULL) {
+            // A failed realloc() leaves the block where it was.
+            live_insert(rec.ptr, old, old_size);
+            live_bytes += old_size;
+        }
+    }
+
+    // The kernel keeps the high water mark; the table is the replay's own.
+    getrusage(RUSAGE_SELF, &usage);
+    peak_rss = (size_t) usage.ru_maxrss * 1024;
+    peak_rss -= MIN(peak_rss, table_size * sizeof(*table));
+    peak_rss = MAX(peak_rss, base);
+
+    if (ret < 0) {
+        fprintf(stderr, "replay: bad trace after %lu records\n", (unsigned long) rec.count);
+    }
+    printf("allocator     %s\n", a->name);
+    printf("records       %lu from %u threads over %.3f s\n"
+           , (unsigned long) rec.count, threads, rec.time / 1e9);
+    printf("unknown       %lu\n", (unsigned long) unknown);
+    printf("time          %.3f s in the allocator, %.3f s in all\n"
+           , alloc_ns / 1e9, (now_ns() - start) / 1e9);
+    printf("ns per call   %.1f\n", rec.count ? (double) alloc_ns / rec.count : 0);
+    printf("peak live     %zu KiB\n", peak_bytes / 1024);
+    printf("peak rss      %zu KiB over %zu KiB to start\n", (peak_rss - base) / 1024, base / 1024);
+    printf("overhead      %.2f\n", peak_bytes ? (double) (peak_rss - base) / peak_bytes : 0);
+    return ret < 0 ? EXIT_FAILURE : 0;
+}
+
+static void *
+system_aligned(size_t alignment, size_t size)
+{
+    void *ptr = NULL;
+
+    if (posix_memalign(&ptr, MAX(alignment, sizeof(void *)), size) != 0) {
+        return NULL;
+    }
+    return ptr;
+}
+
+// Block addresses differ mostly in their middle bits, which the multiply
+//   spreads into the high bits the slot is taken from.
+static size_t
+live_hash(uint64_t id)
+{
+    return (size_t) ((id * 0x9e3779b97f4a7c15ULL) >> 24) & (table_size - 1);
+}
+
+static struct live_block *
+live_find(uint64_t id)
+{
+    size_t i = live_hash(id);
+
+    while (table[i].id != 0) {
+        if (table[i].id == id) {
+            return &table[i];
+        }
+        i = (i + 1) & (table_size - 1);
+    }
+    return NULL;
+}
+
+static void
+live_insert(uint64_t id, void *ptr, size_t size)
+{
+    size_t i = 0;
+
+    if (table_used * 2 >= table_size) {
+        live_grow();
+    }
+    i = live_hash(id);
+    while (table[i].id != 0 && table[i].id != id) {
+        i = (i + 1) & (table_size - 1);
+    }
+    if (table[i].id == 0) {
+        table_used++;
+    }
+    table[i].id = id;
+    table[i].ptr = ptr;
+    table[i].size = size;
+}
+
+// Linear probing without tombstones: the entries after the hole that
+//   would have landed at or before it move back into it.
+static void
+live_remove(struct live_block *b)
+{
+    size_t hole = b - table;
+    size_t i = hole;
+
+    table[hole].id = 0;
+    table_used--;
+    for (;;) {
+        size_t home = 0;
+
+        i = (i + 1) & (table_size - 1);
+        if (table[i].id == 0) {
+            break;
+        }
+        home = live_hash(table[i].id);
+        if (((i - home) & (table_size - 1)) >= ((i - hole) & (table_size - 1))) {
+            table[hole] = table[i];
+            table[i].id = 0;
+            hole = i;
+        }
+    }
+}
+
+static void
+live_grow(void)
+{
+    struct live_block *old = table;
+    size_t old_size = table_size;
+    size_t i = 0;
+
+    table_size = old_size ? old_size * 2 : 4096;
+    table = mmap(NULL, table_size * sizeof(*table), PROT_READ | PROT_WRITE
+                 , MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED) {
+        perror("replay: mmap");
+        exit(EXIT_FAILURE);
+    }
+    table_used = 0;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].id != 0) {
+            live_insert(old[i].id, old[i].ptr, old[i].size);
+        }
+    }
+    if (old != NULL) {
+        munmap(old, old_size * sizeof(*table));
+    }
+}
+
+// A program writes to what it allocates, so every page of a block is
+//   touched to make it resident as it would have been.
+static void
+touch(void *ptr, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t off = 0;
+
+    for (off = 0; off < size; off += page) {
+        ((volatile char *) ptr)[off] = 1;
+    }
+}
+
+// Resident set size less the live block table, read without malloc().
+static size_t
+rss_bytes(void)
+{
+    char buf[64] = {0};
+    size_t pages = 0;
+    size_t rss = 0;
+
+    if (statm_fd < 0 || pread(statm_fd, buf, sizeof(buf) - 1, 0) <= 0
+        || sscanf(buf, "%*u %zu", &pages) != 1) {
+        return 0;
+    }
+    rss = pages * sysconf(_SC_PAGESIZE);
+    return rss - MIN(rss, table_size * sizeof(*table));
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}